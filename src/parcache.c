@@ -0,0 +1,532 @@
+/***************************************************************************
+ * parcache.c                                                              *
+ *                                                                         *
+ * Content-addressed cache of rendered output.  Entries are keyed by the   *
+ * SHA-256 of the input bytes and of every option that changes the output, *
+ * so the same diff rendered the same way is only ever parsed once.        *
+ *                                                                         *
+ * Usage: pardiff --cache DIR [--cache-size N] ...                         *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+
+#include <dirent.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define PARDIFF_HAVE_SHA_NI
+#endif
+
+#define CACHE_IO_BUF_SIZE 65536
+
+/* leftovers of writers that died are removed after this many seconds */
+#define CACHE_STALE_TMP_AGE 3600
+
+/*
+ * The directory is scanned for eviction when the running total of its
+ * size, kept in the stamp file, passes the limit, and at least this
+ * often in case concurrent writers lost some of what they added to it.
+ */
+#define CACHE_EVICT_INTERVAL 60
+#define CACHE_EVICT_STAMP ".evicted"
+
+/*
+ * SHA-256 of the options and the input names an entry.  The directory
+ * may be shared, so the digest must be one nobody can collide by accident
+ * or on purpose: a hit is served without looking at the input again.
+ */
+#define CACHE_DIGEST_SIZE 32
+
+typedef struct _cache_hash_t {
+    uint32_t state[8];
+    uint64_t total;
+    unsigned char tail[64];
+    size_t   tail_len;
+} cache_hash_t;
+
+typedef struct _cache_entry_t {
+    char   *name;
+    time_t  mtime;
+    off_t   size;
+} cache_entry_t;
+
+static const uint32_t hash_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t
+hash_rotr(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static void
+hash_init(cache_hash_t *h)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memset(h, 0, sizeof(*h));
+    memcpy(h->state, iv, sizeof(iv));
+}
+
+#ifdef PARDIFF_HAVE_SHA_NI
+/*
+ * The blocks through the SHA extensions, where the processor has them;
+ * this runs several times faster than the plain code, which is slower
+ * than rendering the input would be.  The state is kept as ABEF and CDGH
+ * halves, the order the round instructions want.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+hash_blocks_sha_ni(uint32_t state[8], const unsigned char *p, size_t n)
+{
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; n >= 64; p += 64, n -= 64) {
+        const __m128i abef_save = abef;
+        const __m128i cdgh_save = cdgh;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; ++i) {
+            /* w holds the last four groups of the schedule, i & 3 the oldest */
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), swap);
+            } else {
+                const __m128i last = w[(i + 3) & 3];
+                const __m128i mid = _mm_alignr_epi8(last, w[(i + 2) & 3], 4);
+                w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), mid), last);
+            }
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&hash_k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static int
+hash_have_sha_ni(void)
+{
+    static int have = -1;
+    unsigned a, b, c, d;
+
+    if (have < 0) {
+        have = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1) && (c & bit_SSSE3)
+            && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA);
+    }
+    return have;
+}
+#endif
+
+static void
+hash_blocks(cache_hash_t *h, const unsigned char *p, size_t n)
+{
+    uint32_t w[64];
+
+#ifdef PARDIFF_HAVE_SHA_NI
+    if (hash_have_sha_ni()) {
+        hash_blocks_sha_ni(h->state, p, n);
+        return;
+    }
+#endif
+    for (; n >= 64; p += 64, n -= 64) {
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+                 | (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = hash_rotr(w[i - 15], 7) ^ hash_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = hash_rotr(w[i - 2], 17) ^ hash_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h->state[0], b = h->state[1], c = h->state[2], d = h->state[3];
+        uint32_t e = h->state[4], f = h->state[5], g = h->state[6], k = h->state[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = k + (hash_rotr(e, 6) ^ hash_rotr(e, 11) ^ hash_rotr(e, 25))
+                              + ((e & f) ^ (~e & g)) + hash_k[i] + w[i];
+            const uint32_t t2 = (hash_rotr(a, 2) ^ hash_rotr(a, 13) ^ hash_rotr(a, 22))
+                              + ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h->state[0] += a;
+        h->state[1] += b;
+        h->state[2] += c;
+        h->state[3] += d;
+        h->state[4] += e;
+        h->state[5] += f;
+        h->state[6] += g;
+        h->state[7] += k;
+    }
+}
+
+static void
+hash_update(cache_hash_t *h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    h->total += len;
+    if (h->tail_len > 0) {
+        size_t n = sizeof(h->tail) - h->tail_len;
+        if (n > len) n = len;
+        memcpy(h->tail + h->tail_len, p, n);
+        h->tail_len += n;
+        p += n;
+        len -= n;
+        if (h->tail_len < sizeof(h->tail)) return;
+        hash_blocks(h, h->tail, sizeof(h->tail));
+        h->tail_len = 0;
+    }
+
+    const size_t whole = len & ~(size_t)63;
+    hash_blocks(h, p, whole);
+    memcpy(h->tail, p + whole, len - whole);
+    h->tail_len = len - whole;
+}
+
+static void
+hash_final(cache_hash_t *h, unsigned char digest[CACHE_DIGEST_SIZE])
+{
+    const uint64_t bits = h->total * 8;
+    unsigned char pad[128];
+    const size_t n = (h->tail_len < 56 ? 64 : 128) - h->tail_len;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; ++i) {
+        pad[n - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    hash_update(h, pad, n);
+
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = (unsigned char)(h->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h->state[i];
+    }
+}
+
+static int
+cache_path(char *buf, size_t size, const char *dir, const char *name)
+{
+    const int n = snprintf(buf, size, "%s/%s", dir, name);
+    return n > 0 && (size_t)n < size;
+}
+
+/*
+ * Copy size bytes of fd to stdout, in the kernel where it can be done.
+ */
+static int
+cache_copy_out(int fd, off_t size)
+{
+    static char buf[CACHE_IO_BUF_SIZE];
+    off_t off = 0;
+
+    fflush(stdout);
+#ifdef __linux__
+    while (off < size) {
+        const ssize_t n = sendfile(STDOUT_FILENO, fd, &off, (size_t)(size - off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+#endif
+    if (off < size && lseek(fd, off, SEEK_SET) != off) return 1;
+    while (off < size) {
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        for (ssize_t w = 0; w < n; ) {
+            const ssize_t m = write(STDOUT_FILENO, buf + w, (size_t)(n - w));
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return 1;
+            w += m;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static int
+cache_entry_older(const void *a, const void *b)
+{
+    const cache_entry_t *ea = (const cache_entry_t *)a;
+    const cache_entry_t *eb = (const cache_entry_t *)b;
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/*
+ * Drop the least recently used entries until the cache fits in limit,
+ * and return what is left.  Hits refresh the entry mtime, so mtime
+ * order is LRU order.  Removing an entry another process is reading is
+ * harmless: it keeps its fd.
+ */
+static long long
+cache_evict(const char *dir, long long limit)
+{
+    char path[PARDIFF_LINE_BUF_SIZE];
+    struct stat st;
+    cache_entry_t *entries = NULL;
+    size_t nentries = 0;
+    size_t arsz = 0;
+    long long total = 0;
+    const time_t now = time(NULL);
+
+    DIR *dp = opendir(dir);
+    if (!dp) return -1;
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (!cache_path(path, sizeof(path), dir, de->d_name)) continue;
+        if (de->d_name[0] == '.') {
+            if (strncmp(de->d_name, ".tmp-", 5) == 0 && stat(path, &st) == 0
+                && now - st.st_mtime > CACHE_STALE_TMP_AGE) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (nentries == arsz) {
+            arsz = arsz ? arsz * 2 : 64;
+            cache_entry_t *grown = (cache_entry_t *)realloc(entries, sizeof(*entries) * arsz);
+            if (!grown) abort();
+            entries = grown;
+        }
+        entries[nentries].name = strdup(de->d_name);
+        if (!entries[nentries].name) abort();
+        entries[nentries].mtime = st.st_mtime;
+        entries[nentries].size = st.st_size;
+        total += st.st_size;
+        ++nentries;
+    }
+    closedir(dp);
+
+    if (total > limit) {
+        qsort(entries, nentries, sizeof(*entries), cache_entry_older);
+        for (size_t i = 0; i < nentries && total > limit; ++i) {
+            if (cache_path(path, sizeof(path), dir, entries[i].name)) {
+                unlink(path);
+            }
+            total -= entries[i].size;
+        }
+    }
+
+    for (size_t i = 0; i < nentries; ++i) {
+        free(entries[i].name);
+    }
+    free(entries);
+    return total;
+}
+
+/*
+ * Evict after a miss added added bytes, if the cache may be over limit.
+ * The stamp holds the running total and when the directory was last
+ * scanned; an update lost to a concurrent writer is put right by the
+ * next scan.
+ */
+static void
+cache_maybe_evict(const char *dir, long long limit, long long added)
+{
+    char stamp[PARDIFF_LINE_BUF_SIZE];
+    long long usage = -1;
+    long long scanned = 0;
+    const time_t now = time(NULL);
+
+    if (!cache_path(stamp, sizeof(stamp), dir, CACHE_EVICT_STAMP)) return;
+    FILE *fp = fopen(stamp, "r+");
+    if (fp && fscanf(fp, "%lld %lld", &usage, &scanned) == 2
+        && now - scanned < CACHE_EVICT_INTERVAL && usage + added <= limit) {
+        usage += added;
+    } else {
+        usage = cache_evict(dir, limit);
+        scanned = now;
+        if (!fp) fp = fopen(stamp, "w");
+    }
+    if (fp) {
+        rewind(fp);
+        fprintf(fp, "%-20lld %-20lld\n", usage, scanned);
+        fclose(fp);
+    }
+}
+
+/*
+ * Hash the input.  A regular file is read twice, once here and once by
+ * the renderer on a miss; anything else is spooled to a temporary file
+ * as it is hashed, which is then returned for the renderer to read.
+ * On failure *consumed says whether any of fp was read past recovery.
+ */
+static FILE *
+cache_hash_input(FILE *fp, cache_hash_t *h, int *consumed)
+{
+    static char buf[CACHE_IO_BUF_SIZE];
+    struct stat st;
+    FILE *spool = NULL;
+
+    *consumed = 0;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        spool = tmpfile();
+        if (!spool) {
+            perror("tmpfile");
+            return NULL;
+        }
+    }
+
+    const off_t start = spool ? 0 : ftello(fp);
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        *consumed = 1;
+        hash_update(h, buf, n);
+        if (spool && fwrite(buf, 1, n, spool) != n) {
+            perror("fwrite");
+            fclose(spool);
+            return NULL;
+        }
+    }
+    if (ferror(fp)) {
+        perror("fread");
+        if (spool) fclose(spool);
+        return NULL;
+    }
+
+    if (spool) {
+        rewind(spool);
+        return spool;
+    }
+    if (fseeko(fp, start, SEEK_SET) != 0) {
+        perror("fseek");
+        return NULL;
+    }
+    return fp;
+}
+
+int
+pardiff_cache_render(const char *prog, const char *dir, long long limit,
+                     const char *opts, FILE *fp,
+                     int (*render)(const char *prog, FILE *fp))
+{
+    char name[2 * CACHE_DIGEST_SIZE + 1];
+    unsigned char digest[CACHE_DIGEST_SIZE];
+    char path[PARDIFF_LINE_BUF_SIZE];
+    char tmp_path[PARDIFF_LINE_BUF_SIZE];
+    struct stat st;
+    cache_hash_t h;
+
+    /* the options go first, with a separator they cannot contain */
+    hash_init(&h);
+    hash_update(&h, opts, strlen(opts) + 1);
+
+    int consumed = 0;
+    FILE *in = cache_hash_input(fp, &h, &consumed);
+    if (!in) {
+        /* what was read of a pipe is gone, so it cannot be rendered */
+        if (consumed) return 1;
+        return render(prog, fp);
+    }
+
+    hash_final(&h, digest);
+    for (int i = 0; i < CACHE_DIGEST_SIZE; ++i) {
+        snprintf(name + 2 * i, 3, "%02x", digest[i]);
+    }
+    if (!cache_path(path, sizeof(path), dir, name)
+        || !cache_path(tmp_path, sizeof(tmp_path), dir, ".tmp-XXXXXX")) {
+        fprintf(stderr, "%s: cache directory name too long: %s\n", prog, dir);
+        const int rc = render(prog, in);
+        if (in != fp) fclose(in);
+        return rc;
+    }
+
+    /* hit: refresh the LRU stamp and stream the stored output */
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        if (in != fp) fclose(in);
+        utimensat(AT_FDCWD, path, NULL, 0);
+        const int rc = (fstat(fd, &st) == 0) ? cache_copy_out(fd, st.st_size) : 1;
+        close(fd);
+        return rc;
+    }
+
+    /*
+     * Miss: render into a private temporary file, then publish it with
+     * an atomic rename so readers never see a partial entry.
+     */
+    mkdir(dir, 0777);
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        const int rc = render(prog, in);
+        if (in != fp) fclose(in);
+        return rc;
+    }
+
+    fflush(stdout);
+    const int stdout_fd = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    const int rc = render(prog, in);
+    PARDIFF_PROBE(flush);
+    const int write_failed = (fflush(stdout) != 0);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    clearerr(stdout);
+    if (in != fp) fclose(in);
+
+    if (rc == 0 && !write_failed) {
+        fchmod(fd, 0644);
+        if (rename(tmp_path, path) != 0) unlink(tmp_path);
+    } else {
+        unlink(tmp_path);
+    }
+
+    const int have_st = (fstat(fd, &st) == 0);
+    const int copy_rc = have_st ? cache_copy_out(fd, st.st_size) : 1;
+    close(fd);
+
+    if (rc == 0 && !write_failed && have_st) {
+        cache_maybe_evict(dir, limit, (long long)st.st_size);
+    }
+    return rc ? rc : copy_rc;
+}
+
+#endif /* !PARDIFF_IS_DOS */
@@ -29,19 +29,30 @@ typedef struct _pardiff_t {
     int  window_width;
     char linenum1[32];
     char linenum2[32];
-    int  change1;
-    int  change2;
+    long long change1;
+    long long change2;
     int  width1;
     int  width2;
+    long long changed1;     /* '!' lines on the old side */
+    long long changed2;     /* '!' lines on the new side */
+    long long deleted;      /* '-' lines */
+    long long added;        /* '+' lines */
+    int  memo;              /* looking for repeated hunks */
+    char cur_file[PARDIFF_LINE_BUF_SIZE];  /* file of a recursive diff */
 } pardiff_t;
 
 typedef struct _list_element_t {
-    char *line;
+    char   *line;
+    size_t len;
+    long long bin_lines;    /* > 0 if this stands for binary lines */
+    long long bin_bytes;
+    int    clipped;         /* the reader kept only the start of it */
     struct _list_element_t *next;
 } list_element_t;
 
 typedef struct _list_t {
-    int    len;
+    long long len;
+    int    width;   /* widest line seen, in tab-expanded columns */
     struct _list_element_t *head;
     struct _list_element_t *cur;
     struct _list_element_t *tail;
@@ -50,44 +61,75 @@ typedef struct _list_t {
 /*
  * Linked list API
  */
-static int  add_list(list_t *list, const char *in_line);
-static int  get_list_len(list_t *list);
+static int  add_list(list_t *list, const char *in_line, size_t len, int width);
+static void add_binary(list_t *list, char tag, size_t len, int max_width);
+static long long get_list_len(list_t *list);
+static int  get_list_width(list_t *list);
 static char *get_list_first(list_t *list);
-static char *get_list_next(list_t *list);
+static char *get_list_next(list_t *list, size_t *len, int *clipped);
 static void free_list(list_t *list);
 
 /*
  * Context diff processing functions
  */
-static int  get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx);
-static void process_file(FILE *fp, pardiff_t *ctx);
+static int  get_diff_file_names(const char *prog, pardiff_reader_t *rd, pardiff_t *ctx);
+static void process_file(pardiff_reader_t *rd, pardiff_t *ctx);
 static void print_lists(list_t *l1, list_t *l2, pardiff_t *ctx);
-static void detab_line(char *in_line, size_t in_line_len);
+static void finish_hunk(list_t *l1, list_t *l2, pardiff_t *ctx);
+static void set_cur_file(pardiff_t *ctx, const char *name);
+static void put_row(const char *cp1, size_t len1, int clipped1, int width1,
+                    const char *cp2, size_t len2, int clipped2, int width2);
+static void put_footer(int width1, int width2);
+static void key_list(list_t *list);
+static int  detab_width(const char *in_line, size_t len, int max_width);
+static int  put_detab(const char *in_line, size_t len, int width, int clipped);
 
 int
 pardiff_context_main(const char *prog, FILE *fp)
 {
     pardiff_t ctx;
+    pardiff_reader_t rd;
+    int rc = 0;
     memset(&ctx, 0, sizeof(ctx));
 
     ctx.window_width = get_term_width();
 
-    if (get_diff_file_names(prog, fp, &ctx) == 1) {
-        return 1;
+    if (pardiff_summary_active()) {
+        pardiff_summary_begin();
     }
-    process_file(fp, &ctx);
-    return 0;
+    pardiff_memo_reset();
+    ctx.memo = !pardiff_summary_active() && pardiff_memo_mode() == PARDIFF_MEMO_COLLAPSE;
+
+    pardiff_reader_init(&rd, fp);
+    if (get_diff_file_names(prog, &rd, &ctx) == 1) {
+        rc = 1;
+    }
+    else {
+        set_cur_file(&ctx, ctx.file2);
+        process_file(&rd, &ctx);
+        if (pardiff_summary_active()) {
+            pardiff_summary_end();
+        }
+    }
+    pardiff_reader_free(&rd);
+    free(ctx.file1);
+    free(ctx.file2);
+    return rc;
 }
 
-static int add_list(list_t *list, const char *in_line)
+static int add_list(list_t *list, const char *in_line, size_t len, int width)
 {
     list_element_t *element;
 
     element = (list_element_t *)calloc(1, sizeof(list_element_t));
     if (!element) abort();
 
-    element->line = _strdup(in_line);
+    /* copied by length, the line may hold NUL bytes */
+    element->line = (char *)malloc(len + 1);
     if (!element->line) abort();
+    memcpy(element->line, in_line, len);
+    element->line[len] = '\0';
+    element->len = len;
 
     if (list->head == NULL) {
         list->head = element;
@@ -98,18 +140,30 @@ static int add_list(list_t *list, const char *in_line)
         list->tail = element;
     }
     list->len++;
+    if (list->width < width) {
+        list->width = width;
+    }
     return 0;
 }
 
-static int get_list_len(list_t *list)
+static long long get_list_len(list_t *list)
 {
-    int len = -1;
+    long long len = -1;
     if (list) {
         len = list->len;
     }
     return len;
 }
 
+static int get_list_width(list_t *list)
+{
+    int width = -1;
+    if (list && list->len > 0) {
+        width = list->width;
+    }
+    return width;
+}
+
 static char *get_list_first(list_t *list)
 {
     char *cp = NULL;
@@ -124,18 +178,50 @@ static char *get_list_first(list_t *list)
     return cp;
 }
 
-static char *get_list_next(list_t *list)
+static char *get_list_next(list_t *list, size_t *len, int *clipped)
 {
     char *cp = NULL;
     if (list) {
         if (list->cur) {
             cp = list->cur->line;
+            *len = list->cur->len;
+            *clipped = list->cur->clipped;
             list->cur = list->cur->next;
         }
     }
     return cp;
 }
 
+/*
+ * A run of binary lines is kept as a single line describing it, so a
+ * binary hunk shows up as one row instead of pages of junk.
+ */
+static void add_binary(list_t *list, char tag, size_t len, int max_width)
+{
+    char note[80];
+    list_element_t *tail = list->tail;
+
+    if (!tail || tail->bin_lines == 0 || tail->line[0] != tag) {
+        add_list(list, "", 0, 0);
+        tail = list->tail;
+    }
+    tail->bin_lines++;
+    tail->bin_bytes += (long long)(len > 2 ? len - 2 : 0);  /* not the tag */
+
+    const int n = snprintf(note, sizeof(note), "%c <binary data: %lld line%s, %lld bytes>",
+                           tag, tail->bin_lines, tail->bin_lines == 1 ? "" : "s",
+                           tail->bin_bytes);
+    free(tail->line);
+    tail->line = _strdup(note);
+    if (!tail->line) abort();
+    tail->len = (size_t)n < sizeof(note) ? (size_t)n : sizeof(note) - 1;
+
+    const int width = detab_width(tail->line, tail->len, max_width);
+    if (list->width < width) {
+        list->width = width;
+    }
+}
+
 static void free_list(list_t *list)
 {
     list_element_t *cur = list->head;
@@ -148,46 +234,67 @@ static void free_list(list_t *list)
     memset(list, 0, sizeof(*list));
 }
 
+/*
+ * Apply the hunk filters.  A context diff hunk has no command letter,
+ * so it is taken from the change markers: '!' on either side, or lines
+ * on both, make a change, otherwise it is an add or a delete.
+ */
+static int hunk_selected(list_t *l1, list_t *l2, pardiff_t *ctx)
+{
+    long long x1, x2, y1, y2;
+    char *ep;
+
+    const char cmd = (ctx->changed1 || ctx->changed2 || (ctx->deleted && ctx->added))
+                   ? 'c' : (ctx->deleted ? 'd' : 'a');
+
+    x1 = x2 = strtoll(ctx->linenum1, &ep, 10);
+    if (*ep == ',') x2 = strtoll(ep + 1, NULL, 10);
+    y1 = y2 = strtoll(ctx->linenum2, &ep, 10);
+    if (*ep == ',') y2 = strtoll(ep + 1, NULL, 10);
+    if (!pardiff_filter_hunk(cmd, x1, x2, y1, y2)) {
+        return 0;
+    }
+
+    if (pardiff_filter_text_active()) {
+        pardiff_filter_text_begin();
+        for (list_element_t *cur = l1->head; cur; cur = cur->next) {
+            if (cur->line[0] != ' ' && cur->len >= 2) {
+                pardiff_filter_text_line(0, cur->line + 2, cur->len - 2);
+            }
+        }
+        for (list_element_t *cur = l2->head; cur; cur = cur->next) {
+            if (cur->line[0] != ' ' && cur->len >= 2) {
+                pardiff_filter_text_line(1, cur->line + 2, cur->len - 2);
+            }
+        }
+        return pardiff_filter_text_end();
+    }
+    return 1;
+}
+
 static void print_lists(list_t *l1, list_t *l2, pardiff_t *ctx)
 {
     char *cp1 = NULL;
     char *cp2 = NULL;
-    int len;
-    int maxlen;
+    size_t len1 = 0;
+    size_t len2 = 0;
+    int clipped1 = 0;
+    int clipped2 = 0;
     int width1;
     int width2;
-    int length_diff = 0;
+    long long length_diff = 0;
 
     if (get_list_len(l1) <= 0 && get_list_len(l2) <= 0) {
         return;
     }
+    PARDIFF_PROBE2(context_flush, get_list_len(l1), get_list_len(l2));
+    if (pardiff_filter_active() && !hunk_selected(l1, l2, ctx)) {
+        return;
+    }
 
-    /* get line max length of each list */
-    get_list_first(l1);
-    get_list_first(l2);
-    maxlen = -1;
-    do {
-        cp1 = get_list_next(l1);
-        if (cp1) {
-            len = (int)strlen(cp1);
-            if (maxlen < len) {
-                maxlen = len;
-            }
-        }
-    } while (cp1);
-    ctx->width1 = maxlen;
-
-    maxlen = -1;
-    do {
-        cp2 = get_list_next(l2);
-        if (cp2) {
-            len = (int)strlen(cp2);
-            if (maxlen < len) {
-                maxlen = len;
-            }
-        }
-    } while (cp2);
-    ctx->width2 = maxlen;
+    /* widths were measured as the lines were read */
+    ctx->width1 = get_list_width(l1);
+    ctx->width2 = get_list_width(l2);
 
     /*
      * Print output adds 3 characters, so must subtract from window width
@@ -218,6 +325,30 @@ static void print_lists(list_t *l1, list_t *l2, pardiff_t *ctx)
     }
     printf("+\n");
 
+    if (ctx->memo) {
+        /* everything the rendered body depends on */
+        const long long layout[4] = { width1, width2, ctx->change1, ctx->change2 };
+        pardiff_memo_key_begin();
+        pardiff_memo_key_add(layout, sizeof(layout));
+        key_list(l1);
+        key_list(l2);
+
+        const char *const seen = pardiff_memo_find();
+        if (seen && pardiff_memo_mode() == PARDIFF_MEMO_COLLAPSE) {
+            char note[PARDIFF_LINE_BUF_SIZE + 80];
+            const int n = snprintf(note, sizeof(note), "<same as %s>", seen);
+            const size_t note_len = n < (int)sizeof(note) ? (size_t)n : sizeof(note) - 1;
+            put_row(note, note_len, 0, width1, note, note_len, 0, width2);
+            put_footer(width1, width2);
+            return;
+        }
+        if (seen) {
+            pardiff_memo_write();
+            return;
+        }
+        pardiff_memo_capture();
+    }
+
     /*
      * When the number of lines before the first change line (line
      * starting with !) differ, must emit blank additional blank
@@ -233,80 +364,159 @@ static void print_lists(list_t *l1, list_t *l2, pardiff_t *ctx)
         if (length_diff) {
             if (length_diff < 0) {
                 cp1 = NULL;
-                cp2 = get_list_next(l2);
+                cp2 = get_list_next(l2, &len2, &clipped2);
                 length_diff++;
             }
             else {
-                cp1 = get_list_next(l1);
+                cp1 = get_list_next(l1, &len1, &clipped1);
                 cp2 = NULL;
                 length_diff--;
             }
         }
         else {
-            cp1 = get_list_next(l1);
-            cp2 = get_list_next(l2);
+            cp1 = get_list_next(l1, &len1, &clipped1);
+            cp2 = get_list_next(l2, &len2, &clipped2);
         }
 
-        len = 0;
-        putchar('|');
-        if (cp1) {
-            printf("%.*s", width1, cp1);
-            len = (int)strlen(cp1);
-        }
-        if (len < width1) {
-            printf("%*c", width1-len, ' ');
-        }
-        putchar('|');
+        put_row(cp1, len1, clipped1, width1, cp2, len2, clipped2, width2);
+    } while (cp1 || cp2);
 
-        len = 0;
-        if (cp2) {
-            printf("%.*s", width2, cp2);
-            len = (int)strlen(cp2);
-        }
-        if (len < width2) {
-            printf("%*c", width2-len, ' ');
+    put_footer(width1, width2);
+
+    if (ctx->memo) {
+        char here[PARDIFF_LINE_BUF_SIZE + 128];
+        int n = snprintf(here, sizeof(here), "%s/%s", ctx->linenum1, ctx->linenum2);
+        if (ctx->cur_file[0] != '\0' && n < (int)sizeof(here)) {
+            snprintf(here + n, sizeof(here) - (size_t)n, " in %s", ctx->cur_file);
         }
-        printf("|\n");
-    } while (cp1 || cp2);
+        pardiff_memo_store(here);
+    }
+}
 
-    putchar('+');
-    for (int i = 0; i < width1; i++) {
-        putchar('-');
+/*
+ * One row of the table; a NULL line leaves its cell empty.
+ */
+static void put_row(const char *cp1, size_t len1, int clipped1, int width1,
+                    const char *cp2, size_t len2, int clipped2, int width2)
+{
+    int len = 0;
+    pardiff_out_write("|", 1);
+    if (cp1) {
+        len = put_detab(cp1, len1, width1, clipped1);
     }
-    putchar('+');
-    for (int i = 0; i < width2; i++) {
-        putchar('-');
+    pardiff_out_fill(' ', width1 - len);
+    pardiff_out_write("|", 1);
+
+    len = 0;
+    if (cp2) {
+        len = put_detab(cp2, len2, width2, clipped2);
     }
-    putchar('+');
-    printf("\n\n");
+    pardiff_out_fill(' ', width2 - len);
+    pardiff_out_write("|\n", 2);
 }
 
-static void process_file(FILE *fp, pardiff_t *ctx)
+static void put_footer(int width1, int width2)
 {
-    char line[PARDIFF_LINE_BUF_SIZE];
+    pardiff_out_write("+", 1);
+    pardiff_out_fill('-', width1);
+    pardiff_out_write("+", 1);
+    pardiff_out_fill('-', width2);
+    pardiff_out_write("+\n\n", 3);
+}
+
+/*
+ * Add the lines of a list to the memo key.
+ */
+static void key_list(list_t *list)
+{
+    for (list_element_t *cur = list->head; cur; cur = cur->next) {
+        const long long info[4] = { (long long)cur->len, cur->bin_lines, cur->bin_bytes, cur->clipped };
+        pardiff_memo_key_add(info, sizeof(info));
+        pardiff_memo_key_add(cur->line, cur->len);
+    }
+}
+
+/*
+ * Name the file the following hunks belong to, from a "--- " header.
+ */
+static void set_cur_file(pardiff_t *ctx, const char *name)
+{
+    size_t len = strcspn(name, "\t");
+    if (len >= sizeof(ctx->cur_file)) {
+        len = sizeof(ctx->cur_file) - 1;
+    }
+    memcpy(ctx->cur_file, name, len);
+    ctx->cur_file[len] = '\0';
+    if (pardiff_summary_active()) {
+        pardiff_summary_file(name, len);
+    }
+}
+
+/*
+ * The end of a hunk: show it, or count it in summary mode.
+ */
+static void finish_hunk(list_t *l1, list_t *l2, pardiff_t *ctx)
+{
+    if (!pardiff_summary_active()) {
+        print_lists(l1, l2, ctx);
+    }
+    else if (ctx->linenum1[0] != '\0' &&
+             (!pardiff_filter_active() || hunk_selected(l1, l2, ctx))) {
+        pardiff_summary_hunk(ctx->added, ctx->deleted, ctx->changed1, ctx->changed2);
+    }
+
+    free_list(l1);
+    free_list(l2);
+    ctx->linenum1[0] = ctx->linenum2[0] = '\0';
+    ctx->change1 = ctx->change2 = -1;
+    ctx->changed1 = ctx->changed2 = 0;
+    ctx->deleted = ctx->added = 0;
+}
+
+static void process_file(pardiff_reader_t *rd, pardiff_t *ctx)
+{
+    char *line;
+    size_t len;
     char *cp;
     char *ep;
     int state = 0;
+    int file_selected = 1;
     list_t list1;
     list_t list2;
-    int linenum;
+    long long linenum;
+    /* in summary mode only the text filters need the lines */
+    const int keep_lines = !pardiff_summary_active() || pardiff_filter_text_active();
 
     ctx->linenum1[0] = ctx->linenum2[0] = '\0';
     memset(&list1, 0, sizeof(list1));
     memset(&list2, 0, sizeof(list2));
     ctx->change1 = ctx->change2 = -1;
     linenum = 0;
-    do {
-        if (!fgets(line, sizeof(line)-1, fp)) {
+    while ((line = pardiff_read_line(rd, &len)) != NULL) {
+        linenum++;
+        if (line[len-1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (strncmp(line, "diff ", 5) == 0) {
+            /* the next file of a recursive diff */
+            finish_hunk(&list1, &list2, ctx);
+            state = 0;
+            file_selected = pardiff_filter_file(line, len);
+            if (!pardiff_summary_active() && pardiff_memo_mode() != PARDIFF_MEMO_OFF) {
+                ctx->memo = 1;
+            }
             continue;
         }
-        linenum++;
-        line[strlen(line)-1] = '\0';
-        detab_line(line, sizeof(line));
+        if (state == 0 && strncmp(line, "--- ", 4) == 0) {
+            set_cur_file(ctx, line + 4);
+        }
         cp = strstr(line, "**********");
         if (cp == line) {
             state = 1;
         }
+        if (!file_selected) {
+            continue;
+        }
 
         if (state == 1) {
             cp = strstr(line, "*** ");
@@ -314,9 +524,7 @@ static void process_file(FILE *fp, pardiff_t *ctx)
                 state = 2;
                 linenum = 0;
 
-                print_lists(&list1, &list2, ctx);
-                ctx->linenum1[0] = ctx->linenum2[0] = '\0';
-                ctx->change1 = ctx->change2 = -1;
+                finish_hunk(&list1, &list2, ctx);
 
                 cp += 4;
                 for (ep = cp; *ep && *ep != ' '; ep++)
@@ -326,9 +534,6 @@ static void process_file(FILE *fp, pardiff_t *ctx)
 #else
                 strncat(ctx->linenum1, cp, ep-cp);
 #endif
-
-                free_list(&list1);
-                free_list(&list2);
             }
         }
         else if (state == 2) {
@@ -351,8 +556,21 @@ static void process_file(FILE *fp, pardiff_t *ctx)
                     if (ctx->change1 == -1) {
                         ctx->change1 = linenum;
                     }
+                    ctx->changed1++;
+                }
+                else if (line[0] == '-') {
+                    ctx->deleted++;
+                }
+                if (!keep_lines) {
+                    continue;
+                }
+                if (pardiff_is_binary(line, len)) {
+                    add_binary(&list1, line[0], len, ctx->window_width);
+                }
+                else {
+                    add_list(&list1, line, len, detab_width(line, len, ctx->window_width));
+                    list1.tail->clipped = rd->clipped;
                 }
-                add_list(&list1, line);
             }
         }
         else if (state == 3) {
@@ -360,20 +578,40 @@ static void process_file(FILE *fp, pardiff_t *ctx)
                     if (ctx->change2 == -1) {
                         ctx->change2 = linenum;
                     }
+                    ctx->changed2++;
+                }
+                else if (line[0] == '+') {
+                    ctx->added++;
+                }
+                if (!keep_lines) {
+                    continue;
+                }
+                if (pardiff_is_binary(line, len)) {
+                    add_binary(&list2, line[0], len, ctx->window_width);
+                }
+                else {
+                    add_list(&list2, line, len, detab_width(line, len, ctx->window_width));
+                    list2.tail->clipped = rd->clipped;
                 }
-                add_list(&list2, line);
         }
-    } while (!feof(fp));
-    print_lists(&list1, &list2, ctx);
+    }
+    finish_hunk(&list1, &list2, ctx);
 }
 
-int get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx)
+int get_diff_file_names(const char *prog, pardiff_reader_t *rd, pardiff_t *ctx)
 {
-    char line[PARDIFF_LINE_BUF_SIZE];
+    char *line;
+    size_t len;
     char *cp;
     char *ep;
 
-    if (fgets(line, sizeof(line)-1, fp)) {
+    line = pardiff_read_line(rd, &len);
+    /* a recursive diff names the files on a line of its own first */
+    while (line && strncmp(line, "diff ", 5) == 0) {
+        pardiff_filter_file(line, len);
+        line = pardiff_read_line(rd, &len);
+    }
+    if (line != NULL) {
         cp = strstr(line, "*** ");
         if (cp != line) {
             fprintf(stderr, "%s: line 1 bad format\n", prog);
@@ -381,8 +619,8 @@ int get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx)
         }
         cp += 4;
 
-        /* 26 = 1 for tab; 24 for date field; 1 for \n from fgets() */
-        ep = line + strlen(line) - 26;
+        /* 26 = 1 for tab; 24 for date field; 1 for \n */
+        ep = line + len - 26;
     } else {
         /* empty input stream */
         return 1;
@@ -397,7 +635,7 @@ int get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx)
 #endif
     ctx->file1[ep-cp] = '\0';
 
-    if (fgets(line, sizeof(line)-1, fp)) {
+    if ((line = pardiff_read_line(rd, &len)) != NULL) {
         cp = strstr(line, "--- ");
         if (cp != line) {
             fprintf(stderr, "%s: line 2 bad format\n", prog);
@@ -405,9 +643,9 @@ int get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx)
         }
         cp += 4;
 
-        /* 26 = 1 for tab; 24 for date field; 1 for \n from fgets() */
+        /* 26 = 1 for tab; 24 for date field; 1 for \n */
 
-        ep = line + strlen(line) - 26;
+        ep = line + len - 26;
     }
     const size_t file2_len = ep - cp;
     ctx->file2 = (char *)malloc(file2_len + 1);
@@ -417,39 +655,82 @@ int get_diff_file_names(const char *prog, FILE *fp, pardiff_t *ctx)
 #else
     strncpy(ctx->file2, cp, file2_len);
 #endif
-    ctx->file1[ep-cp] = '\0';
+    ctx->file2[ep-cp] = '\0';
     return 0;
 }
 
-static void detab_line(char *in_line, size_t in_line_len)
+/*
+ * Tabs are kept in the saved lines and only expanded when printed.
+ * Widths beyond max_width all lead to the same column layout, so the
+ * scan stops there instead of walking the rest of a long line.
+ */
+static int detab_width(const char *in_line, size_t len, int max_width)
 {
-    char line_buf[PARDIFF_LINE_BUF_SIZE];
-
-    int j = 0;
-    for (int i = 0, c_count = 0; in_line[i]; i++) {
-        /*
-         * Count characters on input line
-         */
-        c_count++;
-        if (in_line[i] == '\t') {
-            /*
-             * Loop puts spaces up to tabstop position before nth tabstop.
-             * Trailing printf puts space in nth tabstop position.
-             * c_count is already right for last space put.
-             */
-            for(; c_count % TAB_STOP != 0; j++, c_count++) {
-                line_buf[j] = ' ';
+    int c_count = 0;
+    size_t i = 0;
+    while (i < len && c_count <= max_width) {
+        const size_t run = pardiff_plain_run(in_line + i, len - i);
+        if (run > 0) {
+            c_count += (int)run;
+            i += run;
+        }
+        else if (in_line[i++] == '\t') {
+            c_count += TAB_STOP - (c_count % TAB_STOP);
+        }
+        else {
+            c_count += 2;   /* caret notation */
+        }
+    }
+    return c_count;
+}
+
+/*
+ * Print at most width columns of in_line, expanding tabs and showing
+ * other control characters in caret notation on the way.
+ * Returns the number of columns printed.
+ */
+static int put_detab(const char *in_line, size_t len, int width, int clipped)
+{
+    int c_count = 0;
+    size_t i = 0;
+
+    /* keep the last column for the mark of a clipped line */
+    if (clipped) {
+        --width;
+    }
+    while (i < len && c_count < width) {
+        size_t run = pardiff_plain_run(in_line + i, len - i);
+        if (run > 0) {
+            if (run > (size_t)(width - c_count)) {
+                run = (size_t)(width - c_count);
             }
-            line_buf[j++] = ' ';
+            pardiff_out_write(in_line + i, run);
+            c_count += (int)run;
+            i += run;
+            continue;
+        }
+
+        const unsigned char c = (unsigned char)in_line[i++];
+        if (c == '\t') {
+            int n = TAB_STOP - (c_count % TAB_STOP);
+            if (n > width - c_count) {
+                n = width - c_count;
+            }
+            pardiff_out_fill(' ', n);
+            c_count += n;
         }
         else {
-            line_buf[j++] = in_line[i];
+            const char caret[2] = { '^', (c == 0x7f) ? '?' : (char)(c + '@') };
+            const int n = (c_count + 2 <= width) ? 2 : 1;
+            pardiff_out_write(caret, (size_t)n);
+            c_count += n;
         }
     }
-    line_buf[j++] = '\0';
-#ifdef _MSC_VER
-    strcpy_s(in_line, in_line_len, line_buf);
-#else
-    strcpy(in_line, line_buf);
-#endif
+    if (clipped && width >= 0) {
+        const char mark = PARDIFF_CLIP_MARK;
+        pardiff_out_fill(' ', width - c_count);
+        pardiff_out_write(&mark, 1);
+        c_count = width + 1;
+    }
+    return c_count;
 }
@@ -14,21 +14,58 @@
 
 #include "pardiff.h"
 
+#ifndef PARDIFF_IS_DOS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 static int width_opt = -1;
+static int widths_opt[PARDIFF_MAX_WIDTHS];
+static int nwidths_opt = 0;
+static int context_mode = 0;
+static const char *save_model_opt = NULL;
+static int from_model_opt = 0;
+static const char *source_opt[2] = { NULL, NULL };
+#ifndef PARDIFF_IS_DOS
+static const char *serve_opt = NULL;
+static const char *connect_opt = NULL;
+static int workers_opt = 0;
+static const char *cache_opt = NULL;
+static long long cache_size_opt = PARDIFF_DFLT_CACHE_SIZE;
+static int watch_opt = 0;
+static const char *checkpoint_opt = NULL;
+static long long checkpoint_every_opt = PARDIFF_DFLT_CHECKPOINT_BYTES;
+static int resume_opt = 0;
+static const char *output_opt = NULL;
+#endif
 
-/* buffer to hold one line (similar to max size for vi) */
-static char nextline[PARDIFF_LINE_BUF_SIZE] = "";
-static char putline[PARDIFF_LINE_BUF_SIZE] = "";
+/* the output row being put together, written out whole at its end */
+static char *row = NULL;
+static size_t row_len = 0;
+static size_t row_size = 0;
 
 /* other format data */
 static int col_wid = 0;
 static int term_wid = 0;
+static int eff_term_wid = 0;    /* either real term wid or one less */
+static int num_wid = 0;         /* digits in the line number fields */
 static int left_fill = 0;
 static int center_fill = 0;
 static int right_fill = 0;
 static int got_input = 0;
 static int expand_tab_option = 1;
 
+/* an input file opened ahead of its turn */
+typedef struct _prefetch_t {
+    FILE *fp;
+    int   err;      /* errno if the open failed */
+    int   ring;     /* being opened through the io_uring backend */
+} prefetch_t;
+
+#ifdef PARDIFF_IO_URING
+static int uring_on = 0;
+#endif
+
 /* parser states */
 typedef enum parser_states {
     psUnknown,
@@ -37,108 +74,294 @@ typedef enum parser_states {
     psEchoingF2,    /* copying a text */
     psSavingF1,     /* saving file 1 c text */
     psChewingSep,   /* get rid of dashes between f1 and f2 c text */
-    psEchoingSav    /* outputting parallel text */
+    psEchoingSav,   /* outputting parallel text */
+    psHolding       /* keeping a hunk for the text filters to judge */
 } parserStates;
 
 static void
 print_loop(int x, char c)
 {
-    for ( ; x > 0; --x) {
-        putchar(c);
+    /* a block at a time, a divider row is most of a header line */
+    char run[64];
+    memset(run, c, sizeof(run));
+    for ( ; x > 0; x -= (int)sizeof(run)) {
+        fwrite(run, 1, x < (int)sizeof(run) ? (size_t)x : sizeof(run), stdout);
+    }
+}
+
+/* room for n more bytes of the row */
+static char *
+row_room(size_t n)
+{
+    if (row_len + n > row_size) {
+        row_size = (row_len + n) * 2;
+        char *row_new = (char *)realloc(row, row_size);
+        if (!row_new) abort();
+        row = row_new;
+    }
+    char *const cp = row + row_len;
+    row_len += n;
+    return cp;
+}
+
+static void
+row_put(const char *str, size_t len)
+{
+    memcpy(row_room(len), str, len);
+}
+
+static void
+row_fill(char c, int n)
+{
+    if (n > 0) memset(row_room((size_t)n), c, (size_t)n);
+}
+
+/* n in a field of width columns, as printf's %*lld, or %-*lld with left */
+static void
+row_number(long long n, int width, int left)
+{
+    char digits[24];
+    size_t i = sizeof(digits);
+    unsigned long long u = (n < 0) ? 0 - (unsigned long long)n : (unsigned long long)n;
+    do {
+        digits[--i] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (n < 0) digits[--i] = '-';
+
+    const int len = (int)(sizeof(digits) - i);
+    if (!left) row_fill(' ', width - len);
+    row_put(digits + i, (size_t)len);
+    if (left) row_fill(' ', width - len);
+}
+
+static int
+count_digits(long long n)
+{
+    int digits = 1;
+    for (; n >= 10 || n <= -10; n /= 10) {
+        ++digits;
     }
+    return digits + (n < 0);
+}
+
+/*
+ * Size the line number fields for numbers of num_wid digits.  The widest
+ * number so far is all that is known of a streamed input, so the fields
+ * only ever grow; each divider row keeps the full output width.
+ */
+static void
+set_number_width(int width)
+{
+    num_wid = width;
+
+    /* here, leaving 2*num_wid+1 characters for each pair of line numbers,
+     * centered on the column.  Matches formatting in the routine that
+     * outputs the line number lines.
+     */
+    left_fill = (col_wid / 2) - num_wid;
+    right_fill = left_fill;
+    center_fill = eff_term_wid - left_fill - right_fill - 2 * (2 * num_wid + 1);
 }
 
 static void
-put_number_pair(int n1, int n2)
+put_number_pair(long long n1, long long n2)
 {
-    /* this routine uses the hard-coded 11-char field for file line numbers */
+    /* this routine uses a 2*num_wid+1 char field for file line numbers */
     if (n1 == n2) {
-       printf("---%5d---", n1);
+       const int dashes = (num_wid + 1) / 2;
+       row_fill('-', dashes);
+       row_number(n1, num_wid, 0);
+       row_fill('-', num_wid + 1 - dashes);
     } else {
-       printf("%5d,%-5d", n1, n2);
+       row_number(n1, num_wid, 0);
+       row_put(",", 1);
+       row_number(n2, num_wid, 1);
+    }
+}
+
+static void
+fit_number_width(long long x1, long long x2, long long y1, long long y2)
+{
+    int width = num_wid;
+    if (count_digits(x1) > width) width = count_digits(x1);
+    if (count_digits(x2) > width) width = count_digits(x2);
+    if (count_digits(y1) > width) width = count_digits(y1);
+    if (count_digits(y2) > width) width = count_digits(y2);
+    if (width > num_wid) {
+        set_number_width(width);
     }
 }
 
 static void
-put_number_line(int x1, int x2, int y1, int y2, char c)
+put_number_line(long long x1, long long x2, long long y1, long long y2, char c)
 {
+    fit_number_width(x1, x2, y1, y2);
+
     got_input = 1;
-    print_loop(left_fill, '-');
+    row_fill('-', left_fill);
     put_number_pair(x1, x2);
-    print_loop(center_fill/2, '-');
-    putchar(c);
-    print_loop(center_fill/2, '-');
+    row_fill('-', center_fill/2);
+    row_put(&c, 1);
+    row_fill('-', center_fill/2);
     put_number_pair(y1, y2);
-    print_loop(right_fill, '-');
-    printf("\n");
+    row_fill('-', right_fill);
+    row_put("\n", 1);
+
+    /* not part of the hunk body, so never kept for its repeats */
+    fwrite(row, 1, row_len, stdout);
+    row_len = 0;
 }
 
+/* length of a line without its newline */
+static size_t
+text_len(const char *str, size_t len)
+{
+    return (len > 0 && str[len - 1] == '\n') ? len - 1 : len;
+}
+
+/*
+ * Hunk bodies are written through pardiff_out_write() so that they can
+ * be kept for repeats of the same hunk, a row at a time.
+ */
 static void
 put_fill(void)
 {
-    print_loop(col_wid, ' ');
+    row_fill(' ', col_wid);
 }
 
 static void
 put_sep(void)
 {
-    printf(" | ");
+    row_put(" | ", 3);
+}
+
+static void
+put_eol(void)
+{
+    row_put("\n", 1);
+    pardiff_out_write(row, row_len);
+    row_len = 0;
 }
 
 static void
-put_line(const char *str)
+put_line(const char *str, size_t len, int flags)
 {
-    /* Read one char from the string each time through, mapping into
-     * one or more characters in the output line.
+    if (col_wid <= 0) return;
+    char *const putline = row_room((size_t)col_wid);
+
+    /* Map the string into the output line a run at a time: printable
+     * bytes are copied as they are, tabs are expanded and any other
+     * control byte is shown in caret notation so it cannot move the
+     * cursor or upset the terminal.  A line measured as plain is all
+     * one run.
      */
-    for (int i = 0, i_off = 0, put_i = 0, filling = 0; put_i < col_wid; ++i) {
-        if (filling || (str[i] == '\n')) {
-            putline[put_i++] = ' ';
-            filling = 1;
-        } else if ((str[i] == '\t') && expand_tab_option) {
+    size_t i = 0;
+    int put_i = 0;
+    if (flags & PARDIFF_LINE_PLAIN) {
+        const size_t text = text_len(str, len);
+        put_i = text < (size_t)col_wid ? (int)text : col_wid;
+        memcpy(putline, str, (size_t)put_i);
+        i = len;
+    }
+    while (put_i < col_wid && i < len && str[i] != '\n') {
+        size_t run = pardiff_plain_run(str + i, len - i);
+        if (run > 0) {
+            if (run > (size_t)(col_wid - put_i)) {
+                run = (size_t)(col_wid - put_i);
+            }
+            memcpy(putline + put_i, str + i, run);
+            put_i += (int)run;
+            i += run;
+            continue;
+        }
+
+        const unsigned char c = (unsigned char)str[i++];
+        if (c == '\n') {
+            break;
+        } else if (c == '\t' && expand_tab_option) {
             /* Assume standard tab-stops and calculate how many spaces this
              * one looked like in the input file.
              */
-            int tab_size = 8 - ((i + i_off) % 8);
-            i_off += tab_size - 1;
-            for ( ; tab_size > 0; tab_size--) {
+            for (int tab_size = 8 - (put_i % 8); tab_size > 0 && put_i < col_wid; tab_size--) {
                 putline[put_i++] = ' ';
             }
+        } else if (c == '\t') {
+            putline[put_i++] = (char)c;
         } else {
-            putline[put_i++] = str[i];
+            putline[put_i++] = '^';
+            if (put_i < col_wid) {
+                putline[put_i++] = (c == 0x7f) ? '?' : (char)(c + '@');
+            }
         }
     }
 
-    putline[col_wid] = '\0';
-    printf("%s", putline);
+    memset(putline + put_i, ' ', (size_t)(col_wid - put_i));
+    if (flags & PARDIFF_LINE_CLIPPED) {
+        /* the reader did not keep the rest of this line */
+        putline[col_wid - 1] = PARDIFF_CLIP_MARK;
+    }
+}
+
+/* text shown in place of lines of binary data */
+static char binline[64];
+
+static size_t
+binary_note(long long lines, long long bytes)
+{
+    const int n = snprintf(binline, sizeof(binline), "<binary data: %lld line%s, %lld bytes>",
+                           lines, lines == 1 ? "" : "s", bytes);
+    return n < (int)sizeof(binline) ? (size_t)n : sizeof(binline) - 1;
 }
 
 /* array to save lines in */
 static char **sav_array = NULL;
-static int sav_arsz = 0;
+static char *sav_flags = NULL;
+static size_t sav_arsz = 0;
+static int sav_wid = 0;
 static int putting = 0;
-static int sav_ind = 0;
-static int put_ind = 0;
-static const int SAV_GROW_INCR = 10;
+static size_t sav_ind = 0;
+static size_t put_ind = 0;
+static const size_t SAV_INIT_SIZE = 10;
 
 static void
-init_new_sav_lines(void)
+init_new_sav_lines(size_t from)
 {
-    for (int i = sav_arsz - SAV_GROW_INCR; i < sav_arsz; ++i) {
+    for (size_t i = from; i < sav_arsz; ++i) {
         sav_array[i] = (char *)malloc(sizeof(char) * ((size_t)col_wid + 1));
         if (!sav_array[i]) abort();
     }
 }
 
 static void
-sav_line(const char *str)
+free_sav_lines(void)
+{
+    for (size_t i = 0; i < sav_arsz; ++i) {
+        free(sav_array[i]);
+    }
+    free(sav_array);
+    free(sav_flags);
+    sav_array = NULL;
+    sav_flags = NULL;
+    sav_arsz = 0;
+}
+
+static void
+sav_line(const char *str, size_t len, int flags)
 {
+    /* lines are saved at column width, start over if that changed */
+    if (sav_arsz != 0 && sav_wid != col_wid) {
+        free_sav_lines();
+    }
+
     /* if first call, init things */
     if (sav_arsz == 0) {
-        sav_arsz = SAV_GROW_INCR;
+        sav_wid = col_wid;
+        sav_arsz = SAV_INIT_SIZE;
         sav_array = (char **)malloc(sizeof(char *) * sav_arsz);
-        if (!sav_array) abort();
-        init_new_sav_lines();
+        sav_flags = (char *)malloc(sav_arsz);
+        if (!sav_array || !sav_flags) abort();
+        init_new_sav_lines(0);
         sav_ind = 0;
     }
 
@@ -149,18 +372,25 @@ sav_line(const char *str)
         putting = 0;
 
     } else if (sav_ind == sav_arsz) {
+        /* grow geometrically, a change hunk may be very long */
         char** sav_array_new;
-        sav_arsz += SAV_GROW_INCR;
+        const size_t old_arsz = sav_arsz;
+        sav_arsz *= 2;
+        PARDIFF_PROBE2(sav_grow, old_arsz, sav_arsz);
         sav_array_new = (char **)realloc(sav_array, sizeof(char *) * sav_arsz);
         if (!sav_array_new) abort();
         sav_array = sav_array_new;
-        init_new_sav_lines();
+        char *sav_flags_new = (char *)realloc(sav_flags, sav_arsz);
+        if (!sav_flags_new) abort();
+        sav_flags = sav_flags_new;
+        init_new_sav_lines(old_arsz);
     }
 
+    /* saved raw, translation is left to put_line() */
     char *sav_str = sav_array[sav_ind];
     int i = 0;
     for (int filling = 0; i < col_wid; ++i) {
-        if (filling || (str[i] == '\n')) {
+        if (filling || (size_t)i >= len || (str[i] == '\n')) {
             sav_str[i] = ' ';
             filling = 1;
         } else {
@@ -168,6 +398,7 @@ sav_line(const char *str)
         }
     }
     sav_str[i] = '\0';
+    sav_flags[sav_ind] = (char)flags;
 
     ++sav_ind;
 }
@@ -181,7 +412,8 @@ put_sav_line(void)
     }
 
     if (put_ind < sav_ind) {
-        put_line(sav_array[put_ind++]);
+        put_line(sav_array[put_ind], (size_t)col_wid, sav_flags[put_ind]);
+        ++put_ind;
     } else {
         put_fill();
     }
@@ -191,10 +423,11 @@ static void
 put_other_sav(void)
 {
     while (put_ind < sav_ind) {
-        put_line(sav_array[put_ind++]);
+        put_line(sav_array[put_ind], (size_t)col_wid, sav_flags[put_ind]);
+        ++put_ind;
         put_sep();
         put_fill();
-        printf("\n");
+        put_eol();
     }
 }
 
@@ -220,216 +453,1375 @@ get_term_width(void)
 #endif
 #else
     struct winsize wnsz; /* OS struct storing terminal size */
-    if (ioctl(open("/dev/tty", O_RDONLY), TIOCGWINSZ, &wnsz) == 0) {
-        return wnsz.ws_col;
+    const int tty = open("/dev/tty", O_RDONLY);
+    if (tty >= 0) {
+        const int got = ioctl(tty, TIOCGWINSZ, &wnsz);
+        close(tty);
+        if (got == 0) return wnsz.ws_col;
     }
 #endif
 
     return PARDIFF_DFLT_TERM_WID;
 }
 
+/* state of the hunk being rendered */
+static long long x_count = 0;       /* file 1 lines still to come */
+static long long y_count = 0;       /* file 2 lines still to come */
+static long long bin_lines = 0;     /* binary lines collapsed on this side */
+static long long bin_bytes = 0;
+
+/* raw lines of text kept back, with where each ends and its flags */
+typedef struct _lines_t {
+    char   *text;
+    size_t  size;
+    size_t  len;
+    size_t *ends;
+    char   *flags;
+    size_t  arsz;
+    size_t  lines;
+} lines_t;
+
+/* a hunk held back until the text filters have seen it */
+static lines_t held;
+
+/* for a model, the input from the first hunk that never closes */
+static lines_t tail;
+
+static long long
+hunk_line_count(char cmd, long long x_lines, long long y_lines)
+{
+    switch (cmd) {
+        case 'a': return y_lines;
+        case 'd': return x_lines;
+        case 'c': return x_lines + 1 + y_lines;    /* with the "---" */
+        default:  return 0;
+    }
+}
+
 /*
- * Main routine
+ * Whether the line counts of a hunk bring the renderer back to looking
+ * for a command.  The text of one that does not runs to the end of the
+ * input.
  */
 static int
-pardiff_main(const char *prog, FILE *fp)
+hunk_closes(char cmd, long long x_lines, long long y_lines)
 {
-    int eff_term_wid = 0;       /* either real term wid or one less */
-    int x1 = 0;
-    int x2 = 0;
-    int y1 = 0;
-    int y2 = 0;                 /* parsed numbers from cmd lines */
-    char *strhead = NULL;
-    char *strnext = NULL;
-    char cmdChar = 0;           /* a, d or c */
-    parserStates curState = psUnknown;  /* state of parser machine */
-#ifdef PARDIFF_IS_DOS
-    const int convertCrlf = 0;  /* T => convert lines to UNIX EOL format */
-#else
-    const int convertCrlf = 1;
-#endif
+    switch (cmd) {
+        case 'a': return y_lines > 0;
+        case 'd': return x_lines > 0;
+        case 'c': return x_lines > 0 && y_lines > 0;
+        default:  return 1;
+    }
+}
 
-    /* Calculate format numbers */
-    term_wid = get_term_width();
+/*
+ * Count a hunk in summary mode.
+ */
+static void
+summary_hunk(char cmd, long long x_lines, long long y_lines)
+{
+    switch (cmd) {
+        case 'a': pardiff_summary_hunk(y_lines, 0, 0, 0); break;
+        case 'd': pardiff_summary_hunk(0, x_lines, 0, 0); break;
+        case 'c': pardiff_summary_hunk(0, 0, x_lines, y_lines); break;
+        default:  break;
+    }
+}
 
-    col_wid = (term_wid - 3) / 2;
-    eff_term_wid = (col_wid * 2) + 3;
+/* lines of the source files shown around the hunks */
+static long long ctx_seen = 0;              /* file 1 lines shown or changed */
+static long long ctx_before[2] = { 0, 0 };  /* context ahead of the next hunk */
+static long long ctx_before_n = 0;
+static long long ctx_after[2] = { 0, 0 };   /* context owed after the last one */
+static long long ctx_after_n = 0;
 
-    /* here, leaving 11 characters for line numbers. Matches formatting in
-     * the routine that outputs the line number lines.
-     */
-    left_fill = (col_wid / 2) - 5;
-    right_fill = left_fill;
-    center_fill = eff_term_wid - left_fill - right_fill - 22;
+/*
+ * Output count rows of context, from line a of file 1 and b of file 2.
+ */
+static void
+put_context(long long a, long long b, long long count)
+{
+    const size_t max_len = (size_t)col_wid;
 
-    curState = psNeedCmd;
-    for (;;)
-    {
-        /*
-         * Keep getting the next line till NULL is returned.
-         */
-        if (fgets(nextline, PARDIFF_LINE_BUF_SIZE, fp) == NULL) break;
+    for (; count > 0; --count, ++a, ++b) {
+        size_t len[2] = { 0, 0 };
+        const char *const left = pardiff_source_line(0, a, &len[0]);
+        const char *const right = pardiff_source_line(1, b, &len[1]);
+        if (!left && !right) break;
+        /* no more of a line is looked at than can fill a column */
+        put_line(left ? left : "", len[0] < max_len ? len[0] : max_len, 0);
+        row_put("   ", 3);
+        put_line(right ? right : "", len[1] < max_len ? len[1] : max_len, 0);
+        put_eol();
+    }
+}
 
-        /*
-         * Preprocess lines to get a consistent EOL
-         */
-        if (convertCrlf) {
-#if defined __NetBSD__ || defined __FreeBSD__ || defined __OpenBSD__
-            size_t line_len = strlen(nextline);
-#else
-            size_t line_len = strnlen(nextline, PARDIFF_LINE_BUF_SIZE);
-#endif
-            if (line_len > 2 && nextline[line_len - 2] == '\r') {
-                nextline[line_len - 2] = '\n';
-                nextline[line_len - 1] = '\0';
-            }
-        }
+/*
+ * Every hunk of the input, shown or not, comes through here.  The
+ * context owed to the hunk before is put out as far as this one, and
+ * the context ahead of this one is worked out without going back over
+ * lines already shown or changed.
+ */
+static void
+context_hunk(char cmd, long long x1, long long x2, long long y1)
+{
+    const long long a_before = (cmd == 'a') ? x1 : x1 - 1;
+    const long long b_before = (cmd == 'd') ? y1 : y1 - 1;
 
-        /*
-         * Interpret this line based on the current state of things.
-         */
-        switch (curState) {
-            case psNeedCmd:
-                /*
-                 * Doing exact parsing so diff output lines can be extracted
-                 * out of streams that contain more than just diff output.
-                 */
-                strhead = nextline;
-                x1 = (int)strtol(strhead, &strnext, 10);
-                if (strhead == strnext) break;
-                if (strnext[0] == ',') {
-                    strhead = strnext + 1;
-                    x2 = (int)strtol(strhead, &strnext, 10);
-                    if (strhead == strnext) break;
-                } else {
-                    x2 = x1;
-                }
+    if (ctx_after_n > a_before - ctx_after[0] + 1) {
+        ctx_after_n = a_before - ctx_after[0] + 1;
+    }
+    if (ctx_after_n > 0) {
+        put_context(ctx_after[0], ctx_after[1], ctx_after_n);
+        ctx_seen = ctx_after[0] + ctx_after_n - 1;
+    }
+    ctx_after_n = 0;
 
-                cmdChar = strnext[0];
-                strhead = strnext + 1;
-                y1 = (int)strtol(strhead, &strnext, 10);
-                if (strhead == strnext) break;
-                if (strnext[0] == ',') {
-                    strhead = strnext + 1;
-                    y2 = (int)strtol(strhead, &strnext, 10);
-                    if (strhead == strnext) break;
-                } else {
-                    y2 = y1;
-                }
+    long long from = a_before - pardiff_source_lines() + 1;
+    if (from <= ctx_seen) from = ctx_seen + 1;
+    if (from < 1) from = 1;
+    ctx_before[0] = from;
+    ctx_before[1] = from + (b_before - a_before);
+    ctx_before_n = a_before - from + 1;
+    ctx_seen = (cmd == 'a') ? x1 : x2;
+}
 
-                /* decide the next state based on the diff command type */
-                switch (cmdChar) {
-                    case 'a':
-                        curState = psEchoingF2;
-                        break;
-                    case 'd':
-                        curState = psEchoingF1;
-                        break;
-                    case 'c':
-                        curState = psSavingF1;
-                        break;
-                    default:
-                        break;
-                }
+/*
+ * Parse a command line such as "12,14c20".  Doing exact parsing so diff
+ * output lines can be extracted out of streams that contain more than
+ * just diff output.  Returns 0 if line is not a command.
+ */
+static int
+parse_command(const char *line, char *cmd, long long *x1, long long *x2,
+              long long *y1, long long *y2)
+{
+    const char *strhead = line;
+    char *strnext = NULL;
 
-                /*
-                 * Output the line number header line if we just got a valid
-                 * command.
-                 */
-                put_number_line(x1, x2, y1, y2, cmdChar);
+    *x1 = strtoll(strhead, &strnext, 10);
+    if (strhead == strnext) return 0;
+    if (strnext[0] == ',') {
+        strhead = strnext + 1;
+        *x2 = strtoll(strhead, &strnext, 10);
+        if (strhead == strnext) return 0;
+    } else {
+        *x2 = *x1;
+    }
 
-                /* convert x2,y2 into line counts */
-                x2 = x2 - x1 + 1;
-                y2 = y2 - y1 + 1;
-                break;
+    *cmd = strnext[0];
+    strhead = strnext + 1;
+    *y1 = strtoll(strhead, &strnext, 10);
+    if (strhead == strnext) return 0;
+    if (strnext[0] == ',') {
+        strhead = strnext + 1;
+        *y2 = strtoll(strhead, &strnext, 10);
+        if (strhead == strnext) return 0;
+    } else {
+        *y2 = *y1;
+    }
+    return 1;
+}
 
-            case psEchoingF1:
-                put_line(nextline + 2);
+/*
+ * Output the line number header line for a command and set up for its
+ * text.  Returns the state that reads the first line of text.
+ */
+static parserStates
+start_hunk(char cmd, long long x1, long long x2, long long y1, long long y2)
+{
+    parserStates state = psNeedCmd;
+
+    /* decide the next state based on the diff command type */
+    switch (cmd) {
+        case 'a':
+            state = psEchoingF2;
+            break;
+        case 'd':
+            state = psEchoingF1;
+            break;
+        case 'c':
+            state = psSavingF1;
+            break;
+        default:
+            break;
+    }
+
+    put_number_line(x1, x2, y1, y2, cmd);
+
+    if (pardiff_source_active()) {
+        if (ctx_before_n > 0) {
+            put_context(ctx_before[0], ctx_before[1], ctx_before_n);
+        }
+        ctx_before_n = 0;
+        ctx_after[0] = ctx_seen + 1;
+        ctx_after[1] = (cmd == 'd') ? y1 + 1 : y2 + 1;
+        ctx_after_n = pardiff_source_lines();
+    }
+
+    /* convert x2,y2 into line counts */
+    x_count = x2 - x1 + 1;
+    y_count = y2 - y1 + 1;
+    bin_lines = bin_bytes = 0;
+    return state;
+}
+
+/* whether a line of hunk text is binary data, measured or not */
+static int
+line_is_binary(const char *body, size_t body_len, int flags)
+{
+    if (flags & PARDIFF_LINE_MEASURED) return (flags & PARDIFF_LINE_BINARY) != 0;
+    return pardiff_is_binary(body, body_len);
+}
+
+/*
+ * Render one line of hunk text in the given state.  Returns the state
+ * for the next line.
+ */
+static parserStates
+hunk_text_line(parserStates state, const char *line, size_t line_len, int flags)
+{
+    const char *const body = line + (line_len > 2 ? 2 : line_len);
+    const size_t body_len = line_len > 2 ? line_len - 2 : 0;
+
+    switch (state) {
+        case psEchoingF1:
+            if (bin_lines || line_is_binary(body, body_len, flags)) {
+                ++bin_lines;
+                bin_bytes += (long long)text_len(body, body_len);
+            } else {
+                put_line(body, body_len, flags);
                 put_sep();
                 put_fill();
-                printf("\n");
-                --x2;
-                if (x2 == 0) {
-                    curState = psNeedCmd;
+                put_eol();
+            }
+            --x_count;
+            if (x_count == 0) {
+                if (bin_lines) {
+                    put_line(binline, binary_note(bin_lines, bin_bytes), 0);
+                    put_sep();
+                    put_fill();
+                    put_eol();
+                    bin_lines = bin_bytes = 0;
                 }
-                break;
+                state = psNeedCmd;
+            }
+            break;
 
-            case psEchoingF2:
+        case psEchoingF2:
+            if (bin_lines || line_is_binary(body, body_len, flags)) {
+                ++bin_lines;
+                bin_bytes += (long long)text_len(body, body_len);
+            } else {
                 put_fill();
                 put_sep();
-                put_line(nextline + 2);
-                printf("\n");
-                --y2;
-                if (y2 == 0) {
-                    curState = psNeedCmd;
+                put_line(body, body_len, flags);
+                put_eol();
+            }
+            --y_count;
+            if (y_count == 0) {
+                if (bin_lines) {
+                    put_fill();
+                    put_sep();
+                    put_line(binline, binary_note(bin_lines, bin_bytes), 0);
+                    put_eol();
+                    bin_lines = bin_bytes = 0;
                 }
-                break;
+                state = psNeedCmd;
+            }
+            break;
 
-            case psSavingF1:
-                sav_line(nextline + 2);
-                --x2;
-                if (x2 == 0) {
-                    curState = psChewingSep;
+        case psSavingF1:
+            if (bin_lines || line_is_binary(body, body_len, flags)) {
+                ++bin_lines;
+                bin_bytes += (long long)text_len(body, body_len);
+            } else {
+                sav_line(body, body_len, flags);
+            }
+            --x_count;
+            if (x_count == 0) {
+                if (bin_lines) {
+                    sav_line(binline, binary_note(bin_lines, bin_bytes), 0);
+                    bin_lines = bin_bytes = 0;
                 }
-                break;
+                state = psChewingSep;
+            }
+            break;
 
-            case psChewingSep:
-                curState = psEchoingSav;
-                break;
+        case psChewingSep:
+            state = psEchoingSav;
+            break;
 
-            case psEchoingSav:
+        case psEchoingSav:
+            if (bin_lines || line_is_binary(body, body_len, flags)) {
+                ++bin_lines;
+                bin_bytes += (long long)text_len(body, body_len);
+            } else {
                 put_sav_line();
                 put_sep();
-                put_line(nextline + 2);
-                printf("\n");
-                --y2;
-                if (y2 == 0) {
-                    put_other_sav();
-                    curState = psNeedCmd;
+                put_line(body, body_len, flags);
+                put_eol();
+            }
+            --y_count;
+            if (y_count == 0) {
+                if (bin_lines) {
+                    put_sav_line();
+                    put_sep();
+                    put_line(binline, binary_note(bin_lines, bin_bytes), 0);
+                    put_eol();
+                    bin_lines = bin_bytes = 0;
                 }
-                break;
+                put_other_sav();
+                state = psNeedCmd;
+            }
+            break;
 
-            case psUnknown:
-            default:
-                fprintf(stderr, "%s: internal error, in state %d\n",
-                        prog, curState);
-                exit(1);
-                break;
-        }
+        default:
+            break;
     }
+    return state;
+}
 
-    /* done */
-    if (got_input) {
-        print_loop(eff_term_wid, '-'); printf("\n");
+static void
+hold_line(lines_t *l, const char *line, size_t line_len, int flags)
+{
+    if (l->len + line_len > l->size) {
+        l->size = (l->len + line_len) * 2;
+        char *text_new = (char *)realloc(l->text, l->size);
+        if (!text_new) abort();
+        l->text = text_new;
+    }
+    if (l->lines == l->arsz) {
+        l->arsz = l->arsz ? l->arsz * 2 : 64;
+        size_t *ends_new = (size_t *)realloc(l->ends, sizeof(size_t) * l->arsz);
+        if (!ends_new) abort();
+        l->ends = ends_new;
+        char *flags_new = (char *)realloc(l->flags, l->arsz);
+        if (!flags_new) abort();
+        l->flags = flags_new;
     }
+    memcpy(l->text + l->len, line, line_len);
+    l->len += line_len;
+    l->flags[l->lines] = (char)flags;
+    l->ends[l->lines++] = l->len;
+}
 
-    return 0;
+/*
+ * Kept lines, as a parsed hunk.
+ */
+static void
+held_hunk(pardiff_hunk_t *h, const lines_t *l, char cmd, long long x1, long long x2,
+          long long y1, long long y2)
+{
+    h->cmd = cmd;
+    h->x1 = x1;
+    h->x2 = x2;
+    h->y1 = y1;
+    h->y2 = y2;
+    h->text = l->text;
+    h->len = l->len;
+    h->ends = l->ends;
+    h->flags = l->flags;
+    h->lines = l->lines;
+    h->kind = PARDIFF_HUNK_WHOLE;
+    h->tail = 0;
 }
 
-static int
-do_pardiff(const char *prog, const char *fn, int context_mode)
+/* lines from, on, of a parsed hunk */
+static parserStates
+replay_lines(parserStates state, const pardiff_hunk_t *h, size_t from)
 {
-    FILE *fp = NULL;
-    if (!fn || (fn[0] == '-' && fn[1] == '\0')) {
-        fp = stdin;
+    for (size_t i = from, start = from ? h->ends[from - 1] : 0; i < h->lines; start = h->ends[i++]) {
+        state = hunk_text_line(state, h->text + start, h->ends[i] - start, h->flags[i]);
     }
-    else {
-#ifdef _MSC_VER
-        if (fopen_s(&fp, fn, "r") != 0) fp = NULL;
-#else
-        fp = fopen(fn, "r");
-#endif
-        if (!fp) {
-            perror("fopen");
-            return -1;
-        }
+    return state;
+}
+
+static parserStates
+replay_hunk(parserStates state, const pardiff_hunk_t *h)
+{
+    return replay_lines(state, h, 0);
+}
+
+/*
+ * Feed line n of a hunk, counting from 1, to the text filters.  The
+ * "---" of a change hunk is neither side.
+ */
+static void
+filter_hunk_line(char cmd, long long x_lines, size_t n, const char *line, size_t len)
+{
+    if (len <= 2) return;
+    if (n <= (size_t)x_lines) {
+        pardiff_filter_text_line(0, line + 2, len - 2);
+    } else if (cmd != 'c' || n > (size_t)x_lines + 1) {
+        pardiff_filter_text_line(1, line + 2, len - 2);
     }
+}
 
-    const int rc = context_mode
-        ? pardiff_context_main(prog, fp)
-        : pardiff_main(prog, fp);
+/* file of a recursive diff that the current hunks belong to */
+static char memo_file[PARDIFF_LINE_BUF_SIZE];
 
-    if (fp != stdin) fclose(fp);
+#ifndef PARDIFF_IS_DOS
+/* the "diff" line itself, for a checkpoint to start the file over from */
+static char ckpt_file_line[PARDIFF_LINE_BUF_SIZE];
+static size_t ckpt_file_len = 0;
+
+/* input of the command line being read, and where a resumed render is */
+static int ckpt_operand = 0;
+static const char *ckpt_name = "-";
+static pardiff_checkpoint_t ckpt_resume;
+static int ckpt_resuming = 0;
+#endif
+
+/* the rest of the output is rendered by another process */
+static int output_continues = 0;
+
+static void
+memo_file_name(const char *line, size_t len)
+{
+    while (len > 0 && isspace((unsigned char)line[len - 1])) --len;
+    size_t start = len;
+    while (start > 0 && !isspace((unsigned char)line[start - 1])) --start;
+    memcpy(memo_file, line + start, len - start);
+    memo_file[len - start] = '\0';
+}
+
+static size_t
+format_range(char *buf, size_t size, long long n1, long long n2)
+{
+    const int n = (n1 == n2) ? snprintf(buf, size, "%lld", n1)
+                             : snprintf(buf, size, "%lld,%lld", n1, n2);
+    return n < (int)size ? (size_t)n : size - 1;
+}
+
+/*
+ * Output a whole hunk.  When looking for repeats, a body that was seen
+ * before is written from the memo, or shown as a reference to where it
+ * was first seen; only the line number line is made afresh.
+ */
+static void
+put_hunk(const pardiff_hunk_t *h, int memo)
+{
+    const char cmd = h->cmd;
+    const long long x1 = h->x1;
+    const long long x2 = h->x2;
+    const long long y1 = h->y1;
+    const long long y2 = h->y2;
+    const parserStates state = start_hunk(cmd, x1, x2, y1, y2);
+    if (!memo) {
+        replay_hunk(state, h);
+        return;
+    }
+
+    /* everything the rendered body depends on */
+    const long long counts[2] = { x2 - x1 + 1, y2 - y1 + 1 };
+    const int layout[3] = { cmd, col_wid, expand_tab_option };
+    pardiff_memo_key_begin();
+    pardiff_memo_key_add(counts, sizeof(counts));
+    pardiff_memo_key_add(layout, sizeof(layout));
+    pardiff_memo_key_add(h->ends, h->lines * sizeof(size_t));
+    pardiff_memo_key_add(h->flags, h->lines);
+    pardiff_memo_key_add(h->text, h->len);
+
+    const char *const seen = pardiff_memo_find();
+    if (seen && pardiff_memo_mode() == PARDIFF_MEMO_COLLAPSE) {
+        char note[PARDIFF_LINE_BUF_SIZE + 80];
+        const int n = snprintf(note, sizeof(note), "<same as %s>", seen);
+        const size_t note_len = n < (int)sizeof(note) ? (size_t)n : sizeof(note) - 1;
+        put_line(note, note_len, 0);
+        put_sep();
+        put_line(note, note_len, 0);
+        put_eol();
+    } else if (seen) {
+        pardiff_memo_write();
+    } else {
+        char here[PARDIFF_LINE_BUF_SIZE + 64];
+        size_t len = format_range(here, sizeof(here), x1, x2);
+        here[len++] = cmd;
+        len += format_range(here + len, sizeof(here) - len, y1, y2);
+        if (memo_file[0] != '\0') {
+            snprintf(here + len, sizeof(here) - len, " in %s", memo_file);
+        }
+
+        pardiff_memo_capture();
+        replay_hunk(state, h);
+        pardiff_memo_store(here);
+    }
+}
+
+/*
+ * A "diff" line starts the next file of a recursive diff.  Returns
+ * whether to look for repeated hunks from here on.
+ */
+static int
+next_file(const char *line, size_t len, int filtering, int summary, int memo_mode, int memo)
+{
+    if (filtering) {
+        pardiff_filter_file(line, len);
+    }
+    if (summary) {
+        pardiff_summary_diff_line(line, len);
+    }
+    if (memo_mode != PARDIFF_MEMO_OFF) {
+        memo_file_name(line, len);
+        memo = 1;
+    }
+    return memo;
+}
+
+/*
+ * Set up the format for an output of term_width columns.
+ */
+static void
+begin_output(int term_width)
+{
+    term_wid = term_width;
+
+    col_wid = (term_wid - 3) / 2;
+    eff_term_wid = (col_wid * 2) + 3;
+
+    set_number_width(PARDIFF_MIN_NUM_WID);
+
+    /* nothing from an earlier, possibly truncated, input is kept */
+    got_input = 0;
+    sav_ind = 0;
+    putting = 0;
+    ctx_seen = ctx_before_n = ctx_after_n = 0;
+
+    if (pardiff_summary_active()) {
+        pardiff_summary_begin();
+    }
+    pardiff_memo_reset();
+    memo_file[0] = '\0';
+#ifndef PARDIFF_IS_DOS
+    ckpt_file_len = 0;
+#endif
+}
+
+static void
+end_output(void)
+{
+    if (pardiff_summary_active()) {
+        pardiff_summary_end();
+    }
+    if (ctx_after_n > 0) {
+        put_context(ctx_after[0], ctx_after[1], ctx_after_n);
+        ctx_after_n = 0;
+    }
+    if (got_input) {
+        print_loop(eff_term_wid, '-'); printf("\n");
+    }
+}
+
+#ifndef PARDIFF_IS_DOS
+/*
+ * Everything that changes the rendered output, as part of the key for
+ * the output cache and of a checkpoint.
+ */
+static void
+output_options_key(char *buf, size_t size)
+{
+    snprintf(buf, size, "pardiff " VERSION " w=%d C=%d x=%d S=%d M=%d E=%d",
+             get_term_width(), context_mode, expand_tab_option,
+             pardiff_summary_active(), pardiff_memo_mode(), pardiff_input_encoding());
+    const size_t len = strlen(buf);
+    pardiff_filter_key(buf + len, size - len);
+}
+
+/* the same, with the context lines that the cache never sees */
+static void
+checkpoint_key(char *buf, size_t size)
+{
+    output_options_key(buf, size);
+    const size_t len = strlen(buf);
+    snprintf(buf + len, size - len, " ctx=%d",
+             pardiff_source_active() ? pardiff_source_lines() : -1);
+}
+
+/*
+ * The input of a checkpoint, as its operand and what was open under
+ * that name, for a resume to be sure that it reads on in the same file.
+ */
+static void
+input_identity(const char *name, const struct stat *st, pardiff_checkpoint_t *cp)
+{
+    snprintf(cp->in_name, sizeof(cp->in_name), "%s", name);
+    cp->in_size = (long long)st->st_size;
+    cp->in_mtime = (long long)st->st_mtime;
+    cp->in_dev = (long long)st->st_dev;
+    cp->in_ino = (long long)st->st_ino;
+}
+
+/*
+ * Take a checkpoint between hunks.  The output is flushed to disk first
+ * so the checkpoint never claims more of it than is there.
+ */
+static int
+take_checkpoint(const char *prog, pardiff_reader_t *rd, parserStates state, int memo)
+{
+    pardiff_checkpoint_t cp;
+    struct stat st;
+    memset(&cp, 0, sizeof(cp));
+
+    cp.in_offset = pardiff_reader_tell(rd);
+    if (cp.in_offset < 0 || lseek(fileno(rd->fp), 0, SEEK_CUR) < 0) {
+        fprintf(stderr, "%s: checkpoints need an input file in UTF-8\n", prog);
+        return 1;
+    }
+    if (fstat(fileno(rd->fp), &st) != 0) {
+        perror("fstat");
+        return 1;
+    }
+    input_identity(ckpt_name, &st, &cp);
+    PARDIFF_PROBE(flush);
+    if (fflush(stdout) != 0) {
+        perror("fflush");
+        return 1;
+    }
+    fsync(STDOUT_FILENO);
+    cp.out_offset = (long long)lseek(STDOUT_FILENO, 0, SEEK_CUR);
+
+    checkpoint_key(cp.key, sizeof(cp.key));
+    cp.operand = ckpt_operand;
+    cp.state = state;
+    cp.num_wid = num_wid;
+    cp.got_input = got_input;
+    cp.memo = memo;
+    cp.ctx_seen = ctx_seen;
+    cp.ctx_after[0] = ctx_after[0];
+    cp.ctx_after[1] = ctx_after[1];
+    cp.ctx_after_n = ctx_after_n;
+    memcpy(cp.file_line, ckpt_file_line, ckpt_file_len);
+    cp.file_len = ckpt_file_len;
+    return pardiff_checkpoint_save(checkpoint_opt, &cp);
+}
+
+/*
+ * Pick up a render from the checkpoint: the input is read on from
+ * where it was, and the file it was in and the format are put back.
+ */
+static int
+resume_render(pardiff_reader_t *rd, int filtering, int memo_mode, int *memo)
+{
+    const pardiff_checkpoint_t *const cp = &ckpt_resume;
+
+    ckpt_resuming = 0;
+    if (fseeko(rd->fp, (off_t)cp->in_offset, SEEK_SET) != 0) {
+        perror("fseeko");
+        return 1;
+    }
+    rd->base = cp->in_offset;
+    rd->encoding = PARDIFF_ENC_UTF8;
+    rd->started = 1;
+
+    set_number_width(cp->num_wid);
+    got_input = cp->got_input;
+    ctx_seen = cp->ctx_seen;
+    ctx_after[0] = cp->ctx_after[0];
+    ctx_after[1] = cp->ctx_after[1];
+    ctx_after_n = cp->ctx_after_n;
+    if (cp->file_len > 0) {
+        memcpy(ckpt_file_line, cp->file_line, cp->file_len);
+        ckpt_file_len = cp->file_len;
+        next_file(ckpt_file_line, ckpt_file_len, filtering, 0, memo_mode, 0);
+    }
+    *memo = cp->memo;
+    return 0;
+}
+#endif
+
+/*
+ * Parse a normal diff and render it, or with a model, only keep its
+ * hunks there to be rendered later.
+ */
+static int
+parse_diff(const char *prog, FILE *fp, pardiff_model_t *model)
+{
+    long long x1 = 0;
+    long long x2 = 0;
+    long long y1 = 0;
+    long long y2 = 0;           /* parsed numbers from cmd lines */
+    long long skip_count = 0;   /* lines left in a held hunk */
+    long long held_x = 0;       /* file 1 lines of the held hunk */
+    int held_kind = PARDIFF_HUNK_WHOLE;
+    size_t held_tail = 0;       /* tail line after the held hunk's command */
+    int tail_on = 0;            /* keeping the input for an open hunk */
+    char *nextline = NULL;      /* current input line */
+    size_t line_len = 0;
+    pardiff_reader_t rd;
+    char cmdChar = 0;           /* a, d or c */
+    parserStates curState = psUnknown;  /* state of parser machine */
+    pardiff_hunk_t hunk;
+    const int filtering = !model && pardiff_filter_active();
+    const int filtering_text = !model && pardiff_filter_text_active();
+    const int summary = !model && pardiff_summary_active();
+    const int memo_mode = (summary || model) ? PARDIFF_MEMO_OFF : pardiff_memo_mode();
+    const int context = !summary && !model && pardiff_source_active();
+    int memo = memo_mode == PARDIFF_MEMO_COLLAPSE;  /* looking for repeats */
+#ifdef PARDIFF_IS_DOS
+    const int convertCrlf = 0;  /* T => convert lines to UNIX EOL format */
+#else
+    const int convertCrlf = 1;
+    int checkpoints = checkpoint_opt && !model;
+    long long next_checkpoint = checkpoint_every_opt;
+#endif
+
+    /* Calculate format numbers */
+    begin_output(get_term_width());
+
+    pardiff_reader_init(&rd, fp);
+#ifndef PARDIFF_IS_DOS
+    if (!model && ckpt_resuming
+        && resume_render(&rd, filtering, memo_mode, &memo) != 0) {
+        pardiff_reader_free(&rd);
+        return 1;
+    }
+#endif
+    tail.len = 0;
+    tail.lines = 0;
+    curState = psNeedCmd;
+    for (;;)
+    {
+#ifndef PARDIFF_IS_DOS
+        if (checkpoints && curState == psNeedCmd && rd.offset >= next_checkpoint) {
+            /* a failed checkpoint only costs the time to get here again */
+            checkpoints = take_checkpoint(prog, &rd, curState, memo) == 0;
+            next_checkpoint = rd.offset + checkpoint_every_opt;
+        }
+#endif
+        /*
+         * Keep getting the next line till NULL is returned.
+         */
+        nextline = pardiff_read_line(&rd, &line_len);
+        if (nextline == NULL) break;
+
+        /*
+         * Preprocess lines to get a consistent EOL
+         */
+        if (convertCrlf) {
+            if (line_len > 2 && nextline[line_len - 2] == '\r' && nextline[line_len - 1] == '\n') {
+                nextline[line_len - 2] = '\n';
+                nextline[line_len - 1] = '\0';
+                --line_len;
+            }
+        }
+
+        if (tail_on) {
+            hold_line(&tail, nextline, line_len, rd.clipped ? PARDIFF_LINE_CLIPPED : 0);
+        }
+
+        /*
+         * Interpret this line based on the current state of things.
+         */
+        const parserStates prevState = curState;
+        switch (curState) {
+            case psNeedCmd:
+                if (strncmp(nextline, "diff ", 5) == 0) {
+                    /* the next file of a recursive diff */
+                    if (model) {
+                        memset(&hunk, 0, sizeof(hunk));
+                        hunk.text = nextline;
+                        hunk.len = line_len;
+                        pardiff_model_add(model, &hunk);
+                    }
+                    memo = next_file(nextline, line_len, filtering, summary, memo_mode, memo);
+#ifndef PARDIFF_IS_DOS
+                    if (checkpoints) {
+                        memcpy(ckpt_file_line, nextline, line_len);
+                        ckpt_file_len = line_len;
+                    }
+#endif
+                    break;
+                }
+
+                if (!parse_command(nextline, &cmdChar, &x1, &x2, &y1, &y2)) break;
+
+                PARDIFF_PROBE6(hunk, cmdChar, x1, x2, y1, y2, rd.offset);
+
+                if (context) {
+                    context_hunk(cmdChar, x1, x2, y1);
+                }
+
+                if (model) {
+                    /*
+                     * Every hunk goes in as far as it goes.  Past the first
+                     * one that the renderer would read to the end from, the
+                     * input is kept whole as well.
+                     */
+                    held_kind = PARDIFF_HUNK_WHOLE;
+                    held_tail = tail.lines;
+                    if (!hunk_closes(cmdChar, x2 - x1 + 1, y2 - y1 + 1)) {
+                        held_kind = PARDIFF_HUNK_OPEN;
+                        tail_on = 1;
+                    }
+                    held.len = 0;
+                    held.lines = 0;
+                    skip_count = hunk_line_count(cmdChar, x2 - x1 + 1, y2 - y1 + 1);
+                    if (skip_count > 0) {
+                        curState = psHolding;
+                        break;
+                    }
+                    held_hunk(&hunk, &held, cmdChar, x1, x2, y1, y2);
+                    hunk.kind = held_kind;
+                    hunk.tail = held_tail;
+                    pardiff_model_add(model, &hunk);
+                    break;
+                }
+
+                if (filtering || summary || memo) {
+                    /*
+                     * Rejected hunks, and every hunk in summary mode, are
+                     * passed over without going anywhere near the renderer.
+                     */
+                    skip_count = hunk_line_count(cmdChar, x2 - x1 + 1, y2 - y1 + 1);
+                    if (skip_count <= 0) break;
+                    if (filtering && !pardiff_filter_hunk(cmdChar, x1, x2, y1, y2)) {
+                        pardiff_skip_lines(&rd, skip_count);
+                        break;
+                    }
+                    if (filtering_text || memo) {
+                        held.len = 0;
+                        held.lines = 0;
+                        held_x = (cmdChar == 'a') ? 0 : x2 - x1 + 1;
+                        pardiff_filter_text_begin();
+                        curState = psHolding;
+                        break;
+                    }
+                    if (summary) {
+                        summary_hunk(cmdChar, x2 - x1 + 1, y2 - y1 + 1);
+                        pardiff_skip_lines(&rd, skip_count);
+                        break;
+                    }
+                }
+
+                /*
+                 * Output the line number header line if we just got a valid
+                 * command.
+                 */
+                curState = start_hunk(cmdChar, x1, x2, y1, y2);
+                break;
+
+            case psHolding:
+                hold_line(&held, nextline, line_len, rd.clipped ? PARDIFF_LINE_CLIPPED : 0);
+                if (filtering_text) {
+                    filter_hunk_line(cmdChar, held_x, held.lines, nextline, line_len);
+                }
+                if (--skip_count == 0) {
+                    held_hunk(&hunk, &held, cmdChar, x1, x2, y1, y2);
+                    if (model) {
+                        hunk.kind = held_kind;
+                        hunk.tail = held_tail;
+                        pardiff_model_add(model, &hunk);
+                    } else if (pardiff_filter_text_end()) {
+                        if (summary) {
+                            summary_hunk(cmdChar, x2 - x1 + 1, y2 - y1 + 1);
+                        } else {
+                            put_hunk(&hunk, memo);
+                        }
+                    }
+                    curState = psNeedCmd;
+                }
+                else if (!filtering_text && !model && held.len > PARDIFF_MEMO_HUNK_MAX) {
+                    /* too big to be worth keeping, show it as it comes */
+                    held_hunk(&hunk, &held, cmdChar, x1, x2, y1, y2);
+                    curState = replay_hunk(start_hunk(cmdChar, x1, x2, y1, y2), &hunk);
+                }
+                break;
+
+            case psEchoingF1:
+            case psEchoingF2:
+            case psSavingF1:
+            case psChewingSep:
+            case psEchoingSav:
+                curState = hunk_text_line(curState, nextline, line_len,
+                                          rd.clipped ? PARDIFF_LINE_CLIPPED : 0);
+                break;
+
+            case psUnknown:
+            default:
+                fprintf(stderr, "%s: internal error, in state %d\n",
+                        prog, curState);
+                exit(1);
+                break;
+        }
+        if (curState != prevState) {
+            PARDIFF_PROBE2(state, prevState, curState);
+        }
+    }
+
+    pardiff_reader_free(&rd);
+
+    if (model && curState == psHolding) {
+        /* shown as far as it goes, as it is when the diff is read */
+        held_hunk(&hunk, &held, cmdChar, x1, x2, y1, y2);
+        hunk.kind = held_kind | PARDIFF_HUNK_CUT;
+        hunk.tail = held_tail;
+        pardiff_model_add(model, &hunk);
+    }
+    if (model && tail_on) {
+        held_hunk(&hunk, &tail, 0, 0, 0, 0, 0);
+        hunk.kind = PARDIFF_HUNK_TAIL;
+        pardiff_model_add(model, &hunk);
+    }
+
+    /* done */
+    if (!model && !output_continues) {
+        end_output();
+    }
+
+    return 0;
+}
+
+/*
+ * Main routine
+ */
+static int
+pardiff_main(const char *prog, FILE *fp)
+{
+    return parse_diff(prog, fp, NULL);
+}
+
+/*
+ * Whether a hunk held for repeats grows past what is worth keeping
+ * before its last line is read, and so is shown as it comes.
+ */
+static int
+held_streams(const pardiff_hunk_t *h)
+{
+    size_t before_last = h->len;
+    if (!(h->kind & PARDIFF_HUNK_CUT)) {
+        before_last = h->lines >= 2 ? h->ends[h->lines - 2] : 0;
+    }
+    return before_last > PARDIFF_MEMO_HUNK_MAX;
+}
+
+/*
+ * An open hunk takes the rest of the input for its text, the same as
+ * when the diff is read.
+ */
+static void
+put_open_hunk(const pardiff_model_t *model, const pardiff_hunk_t *h)
+{
+    pardiff_hunk_t t;
+    const parserStates state = start_hunk(h->cmd, h->x1, h->x2, h->y1, h->y2);
+    if (pardiff_model_tail(model, &t)) {
+        replay_lines(state, &t, h->tail);
+    }
+}
+
+/*
+ * Render a parsed model at term_width columns.  Filters, summary mode
+ * and repeats apply here, the same as to a diff being read: a hunk is
+ * held back, and dropped if the input ends in it, or shown as it comes
+ * just as parse_diff() would have.
+ */
+static int
+render_model(const pardiff_model_t *model, int term_width)
+{
+    pardiff_hunk_t h;
+    size_t pos = pardiff_model_start();
+    const int filtering = pardiff_filter_active();
+    const int filtering_text = pardiff_filter_text_active();
+    const int summary = pardiff_summary_active();
+    const int memo_mode = summary ? PARDIFF_MEMO_OFF : pardiff_memo_mode();
+    const int context = !summary && pardiff_source_active();
+    int memo = memo_mode == PARDIFF_MEMO_COLLAPSE;
+
+    begin_output(term_width);
+    while (pardiff_model_next(model, &pos, &h) > 0) {
+        if (h.cmd == 0) {
+            if (h.kind == PARDIFF_HUNK_WHOLE) {
+                memo = next_file(h.text, h.len, filtering, summary, memo_mode, memo);
+            }
+            continue;
+        }
+        if (context) {
+            context_hunk(h.cmd, h.x1, h.x2, h.y1);
+        }
+        if (filtering || summary || memo) {
+            if (hunk_line_count(h.cmd, h.x2 - h.x1 + 1, h.y2 - h.y1 + 1) <= 0) continue;
+            if (filtering && !pardiff_filter_hunk(h.cmd, h.x1, h.x2, h.y1, h.y2)) continue;
+            if (filtering_text || (memo && !held_streams(&h))) {
+                if (h.kind & PARDIFF_HUNK_CUT) continue;
+                if (filtering_text) {
+                    const long long x_lines = (h.cmd == 'a') ? 0 : h.x2 - h.x1 + 1;
+                    pardiff_filter_text_begin();
+                    for (size_t i = 0, start = 0; i < h.lines; start = h.ends[i++]) {
+                        filter_hunk_line(h.cmd, x_lines, i + 1, h.text + start, h.ends[i] - start);
+                    }
+                    if (!pardiff_filter_text_end()) continue;
+                }
+                if (summary) {
+                    summary_hunk(h.cmd, h.x2 - h.x1 + 1, h.y2 - h.y1 + 1);
+                } else {
+                    put_hunk(&h, memo);
+                }
+                continue;
+            }
+            if (summary) {
+                summary_hunk(h.cmd, h.x2 - h.x1 + 1, h.y2 - h.y1 + 1);
+                continue;
+            }
+        }
+        if (h.kind & PARDIFF_HUNK_OPEN) {
+            /* nothing after it is read as a command */
+            put_open_hunk(model, &h);
+            break;
+        }
+        put_hunk(&h, 0);
+    }
+    end_output();
+
+    return 0;
+}
+
+
+/*
+ * Open one input ahead of its turn.  The open is done now so that many
+ * files can be read from the device while earlier ones are rendered;
+ * errors are kept to be reported when the file comes up.
+ */
+static void
+prefetch_input(prefetch_t *pf, int slot, const char *fn)
+{
+    pf->fp = NULL;
+    pf->err = 0;
+    pf->ring = 0;
+    if (fn[0] == '\0') {
+        return;
+    }
+    if (fn[0] == '-' && fn[1] == '\0') {
+        pf->fp = stdin;
+        return;
+    }
+#ifdef PARDIFF_IO_URING
+    if (uring_on) {
+        pardiff_uring_prefetch(slot, fn);
+        pf->ring = 1;
+        return;
+    }
+#else
+    (void)slot;
+#endif
+
+#ifdef _MSC_VER
+    if (fopen_s(&pf->fp, fn, from_model_opt ? "rb" : "r") != 0) pf->fp = NULL;
+#else
+    pf->fp = fopen(fn, from_model_opt ? "rb" : "r");
+#endif
+    if (!pf->fp) {
+        pf->err = errno;
+        return;
+    }
+
+    setvbuf(pf->fp, NULL, _IOFBF, PARDIFF_IO_BUF_SIZE);
+#ifdef POSIX_FADV_WILLNEED
+    /* start asynchronous readahead, returns without waiting for it */
+    posix_fadvise(fileno(pf->fp), 0, PARDIFF_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * The input opened ahead, once its turn has come.
+ */
+static void
+prefetch_take(prefetch_t *pf, int slot)
+{
+#ifdef PARDIFF_IO_URING
+    if (pf->ring) {
+        pf->fp = pardiff_uring_take(slot, &pf->err);
+        pf->ring = 0;
+    }
+#else
+    (void)pf;
+    (void)slot;
+#endif
+}
+
+/*
+ * Parse the input into a model, or read a saved one, then save it or
+ * render it at each of the widths asked for.
+ */
+static int
+do_model(const char *prog, FILE *fp)
+{
+    pardiff_model_t model;
+    int rc = 0;
+
+    pardiff_model_init(&model);
+    if (from_model_opt) {
+        if (pardiff_model_load(&model, fp) != 0) {
+            fprintf(stderr, "%s: not a pardiff model\n", prog);
+            rc = 1;
+        }
+    } else {
+        rc = parse_diff(prog, fp, &model);
+    }
+
+    if (rc == 0 && save_model_opt) {
+        rc = pardiff_model_save(&model, save_model_opt);
+    } else if (rc == 0) {
+        const int n = nwidths_opt > 1 ? nwidths_opt : 1;
+        for (int i = 0; i < n; ++i) {
+            const int width = nwidths_opt > 1 ? widths_opt[i] : get_term_width();
+            if (n > 1) printf("width: %d\n", width);
+            render_model(&model, width);
+            if (i + 1 < n) putchar('\n');
+        }
+    }
+
+    pardiff_model_free(&model);
+    return rc;
+}
+
+static int
+model_wanted(void)
+{
+    return save_model_opt || from_model_opt || nwidths_opt > 1;
+}
+
+#ifndef PARDIFF_IS_DOS
+/* a place between two hunks where the output can be split */
+typedef struct _split_t {
+    long long in;           /* input offset */
+    long long out;          /* output offset */
+    int       num_wid;
+    int       memo;
+} split_t;
+
+/* the parts of an input being rendered at once */
+static const char *split_map = NULL;
+static long long split_size = 0;
+static split_t split_at[PARDIFF_SPLIT_MAX_PARTS];
+static int split_parts = 0;
+
+static long long
+fill_len(int fill)
+{
+    return fill > 0 ? fill : 0;
+}
+
+/*
+ * Go through the input working out where each hunk goes in the output,
+ * with no more than the hunk lines and a count of the lines after each.
+ * Every PARDIFF_SPLIT_BYTES of output a place to split it is kept in
+ * *splits.  Returns the output size, or -1 if the last hunk is cut short
+ * and the size is not known.  If some hunk cannot be sized from its hunk
+ * line, no places are kept and the input has to be rendered in order.
+ */
+static long long
+plan_split(split_t **splits, size_t *nsplits)
+{
+    FILE *const fp = fmemopen((void *)split_map, (size_t)split_size, "r");
+    if (!fp) return -1;
+
+    pardiff_reader_t rd;
+    char *line = NULL;
+    size_t line_len = 0;
+    size_t arsz = 0;
+    long long out = 0;
+    long long hunks = 0;
+    long long next_split = PARDIFF_SPLIT_BYTES;
+    int memo = pardiff_memo_mode() == PARDIFF_MEMO_COLLAPSE;
+    int ok = 1;
+
+    begin_output(get_term_width());
+    const long long row_len = eff_term_wid + 1;
+    *nsplits = 0;
+    pardiff_reader_init(&rd, fp);
+    while (ok && col_wid > 0 && (line = pardiff_read_line(&rd, &line_len)) != NULL) {
+        char cmd = 0;
+        long long x1 = 0;
+        long long x2 = 0;
+        long long y1 = 0;
+        long long y2 = 0;
+        if (strncmp(line, "diff ", 5) == 0) {
+            memo = memo || pardiff_memo_mode() != PARDIFF_MEMO_OFF;
+            continue;
+        }
+        if (!parse_command(line, &cmd, &x1, &x2, &y1, &y2)) continue;
+
+        const long long x_lines = x2 - x1 + 1;
+        const long long y_lines = y2 - y1 + 1;
+        const long long lines = hunk_line_count(cmd, x_lines, y_lines);
+        if (lines <= 0 || !hunk_closes(cmd, x_lines, y_lines)) {
+            ok = 0;     /* not a hunk the renderer takes as it is */
+            break;
+        }
+        fit_number_width(x1, x2, y1, y2);
+        ++hunks;
+        out += fill_len(left_fill) + 2 * (2 * num_wid + 1) + 2 * fill_len(center_fill / 2)
+             + 1 + fill_len(right_fill) + 1;
+
+        const long long start = rd.base + rd.offset;
+        if (pardiff_skip_lines(&rd, lines) < lines) {
+            /* cut short at the end, which the last part renders */
+            out = -1;
+            break;
+        }
+        const long long end = rd.base + rd.offset;
+        if (memchr(split_map + start, '\0', (size_t)(end - start))) {
+            ok = 0;     /* binary data is shown in fewer rows */
+            break;
+        }
+        switch (cmd) {
+            case 'a': out += y_lines * row_len; break;
+            case 'd': out += x_lines * row_len; break;
+            default:  out += (x_lines > y_lines ? x_lines : y_lines) * row_len; break;
+        }
+
+        if (out >= next_split) {
+            if (*nsplits == arsz) {
+                arsz = arsz ? arsz * 2 : 256;
+                split_t *splits_new = (split_t *)realloc(*splits, sizeof(split_t) * arsz);
+                if (!splits_new) abort();
+                *splits = splits_new;
+            }
+            split_t *const sp = &(*splits)[(*nsplits)++];
+            sp->in = end;
+            sp->out = out;
+            sp->num_wid = num_wid;
+            sp->memo = memo;
+            next_split = out + PARDIFF_SPLIT_BYTES;
+        }
+    }
+    if (rd.raw || col_wid <= 0) {
+        ok = 0;     /* offsets of transcoded input are not file offsets */
+    }
+    pardiff_reader_free(&rd);
+    fclose(fp);
+
+    if (!ok) {
+        *nsplits = 0;
+        return -1;
+    }
+    if (out >= 0 && hunks > 0) {
+        out += row_len;     /* the divider at the end */
+    }
+    return out;
+}
+
+/*
+ * Render one part, from the state kept where it starts to where the
+ * next part starts.
+ */
+static int
+render_part(const char *prog, int part)
+{
+    const split_t *const sp = &split_at[part];
+    const long long end = (part + 1 < split_parts) ? split_at[part + 1].in : split_size;
+
+    FILE *const fp = fmemopen((void *)(split_map + sp->in), (size_t)(end - sp->in), "r");
+    if (!fp) {
+        perror("fmemopen");
+        return 1;
+    }
+    if (part > 0) {
+        memset(&ckpt_resume, 0, sizeof(ckpt_resume));
+        ckpt_resume.num_wid = sp->num_wid;
+        ckpt_resume.got_input = 1;
+        ckpt_resume.memo = sp->memo;
+        ckpt_resuming = 1;
+    }
+    output_continues = (part + 1 < split_parts);
+    const int rc = parse_diff(prog, fp, NULL);
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Render a normal diff to the -o file in parts at once, one process to
+ * a part.  Returns -1 if it cannot be done that way and nothing has
+ * been written, for the input to be rendered in order instead.
+ */
+static int
+do_split(const char *prog, FILE *fp)
+{
+    int workers = workers_opt;
+    if (workers <= 0) {
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (workers > PARDIFF_SPLIT_MAX_PARTS) workers = PARDIFF_SPLIT_MAX_PARTS;
+
+    struct stat st;
+    if (workers < 2 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size < PARDIFF_SPLIT_BYTES) {
+        return -1;
+    }
+    void *const map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) return -1;
+    split_map = (const char *)map;
+    split_size = (long long)st.st_size;
+
+    split_t *splits = NULL;
+    size_t nsplits = 0;
+    const long long size = plan_split(&splits, &nsplits);
+
+    /* parts of about the same size, starting at places kept */
+    memset(&split_at[0], 0, sizeof(split_at[0]));
+    split_at[0].num_wid = PARDIFF_MIN_NUM_WID;
+    split_parts = 1;
+    const long long whole = (size >= 0 || nsplits == 0) ? size : splits[nsplits - 1].out;
+    for (size_t i = 0; i < nsplits && split_parts < workers; ++i) {
+        if (splits[i].out * workers >= whole * split_parts) {
+            split_at[split_parts++] = splits[i];
+        }
+    }
+    free(splits);
+
+    int rc = -1;
+    if (split_parts > 1) {
+        long long offsets[PARDIFF_SPLIT_MAX_PARTS];
+        for (int i = 0; i < split_parts; ++i) {
+            offsets[i] = split_at[i].out;
+        }
+        rc = pardiff_output_parts(prog, output_opt, split_parts, offsets,
+                                  size >= 0 ? size : split_at[split_parts - 1].out,
+                                  render_part);
+    }
+    munmap(map, (size_t)st.st_size);
+    split_map = NULL;
+    return rc;
+}
+
+/*
+ * Whether the output is a file and a plain normal diff rendering, for
+ * it to be rendered in parts.
+ */
+static int
+split_wanted(void)
+{
+    return output_opt && !context_mode && !model_wanted() && !pardiff_filter_active()
+        && !pardiff_summary_active() && pardiff_memo_mode() != PARDIFF_MEMO_COLLAPSE
+        && !pardiff_source_active() && !checkpoint_opt && !cache_opt;
+}
+#endif
+
+static int
+do_pardiff(const char *prog, FILE *fp, int context_mode)
+{
+    int rc = 0;
+    if (model_wanted()) {
+        rc = do_model(prog, fp);
+    }
+    else
+#ifndef PARDIFF_IS_DOS
+    if (split_wanted() && (rc = do_split(prog, fp)) >= 0) {
+        /* rendered in parts, each straight to its place in the file */
+    }
+    else if (cache_opt && !pardiff_source_active()) {
+        char opts[PARDIFF_LINE_BUF_SIZE];
+        output_options_key(opts, sizeof(opts));
+        rc = pardiff_cache_render(prog, cache_opt, cache_size_opt, opts, fp,
+                                  context_mode ? pardiff_context_main : pardiff_main);
+    }
+    else
+#endif
+    rc = context_mode
+        ? pardiff_context_main(prog, fp)
+        : pardiff_main(prog, fp);
+
+    if (fp != stdin) fclose(fp);
 
     return rc;
 }
@@ -441,52 +1833,271 @@ pardiff_usage(const char *prog)
             "pardiff " VERSION "\n"
             "usage: %s [options] [file|-] ...\n"
             "options:\n"
-            "  -C            parse context diff format\n"
-            "  -w{width}     use specific width instead of terminal width\n"
-            "  -v            print version information and exit\n"
-            "  -h            print this help and exit\n"
+            "  -C                parse context diff format\n"
+            "  -w{width}         use specific width instead of terminal width\n"
+            "  -w{w1},{w2},...   render the input once at each of several widths\n"
+#ifndef PARDIFF_IS_DOS
+            "  -o FILE           write the output to FILE, large inputs in parallel\n"
+#endif
+            "  --save-model FILE parse the input and save it to render later\n"
+            "  --from-model      the inputs are saved models, not diffs\n"
+            "  --context-from FILE1 FILE2  show context lines from the diffed files\n"
+            "  --context-lines N lines of context shown around each hunk (default 3)\n"
+            "  --input-encoding=ENC  utf-8, utf-16le, utf-16be, latin1 or auto (default)\n"
+            "  --summary         only count hunks and lines, per file and in total\n"
+            "  --collapse-duplicates  show repeated hunks as a reference to the first\n"
+            "  --type=[acd]      only show hunks of these commands\n"
+            "  --lines=FROM-TO   only show hunks touching this line range\n"
+#ifndef PARDIFF_IS_DOS
+            "  --path=GLOB       only show files of a recursive diff matching GLOB\n"
+            "  --grep=REGEX      only show hunks with a changed line matching REGEX\n"
+#endif
+            "  --ignore-blank-lines  hide hunks that only change blank lines\n"
+            "  --ignore-whitespace   hide hunks that only change whitespace\n"
+#ifndef PARDIFF_IS_DOS
+            "  --serve SOCKET    serve requests on a Unix domain socket\n"
+            "  --workers N       number of server or -o worker processes\n"
+            "  --connect SOCKET  have the server on SOCKET do the rendering\n"
+            "  --cache DIR       reuse output cached in DIR for identical input\n"
+            "  --cache-size N    limit the cache to N bytes (K, M or G suffix)\n"
+            "  --watch FILE1 FILE2  compare two files and redraw as they are edited\n"
+            "  --checkpoint FILE write checkpoints of the render to FILE\n"
+            "  --checkpoint-interval N  input read between checkpoints (default 64M)\n"
+            "  --resume          carry on from the checkpoint, output opened with >>\n"
+#endif
+            "  -v                print version information and exit\n"
+            "  -h                print this help and exit\n"
             , prog);
     return 1;
 }
 
 /*
- * Main routine
+ * Match argv[*argi] against a long option taking a value, given either
+ * as "--name=value" or as "--name value".  Returns 0 if it is another
+ * option, 1 if it matched and -1 if the value is missing.
  */
-int
-main(int argc, char *argv[])
+static int
+long_opt_value(int argc, char *argv[], int *argi, const char *name,
+               const char **val)
 {
-    const char *const prog = argv[0];
+    const char *const arg = argv[*argi] + 2;
+    const size_t len = strlen(name);
 
-    int context_mode = 0;
+    if (strncmp(arg, name, len) != 0) return 0;
+    if (arg[len] == '=') {
+        *val = arg + len + 1;
+    } else if (arg[len] == '\0') {
+        if (++*argi >= argc) return -1;
+        *val = argv[*argi];
+    } else {
+        return 0;
+    }
+    return 1;
+}
 
-    int argi = 1;
-    for (; argi < argc; ++argi)
+static int
+parse_count(const char *str)
+{
+    const char *cp = str;
+    while (isdigit((int)*cp)) ++cp;
+    return (cp > str && *cp == '\0') ? atoi(str) : -1;
+}
+
+/*
+ * One width, or several separated by commas.  Returns the first.
+ */
+static int
+parse_widths(const char *str)
+{
+    nwidths_opt = 0;
+    for (const char *cp = str; ; ) {
+        char num[16];
+        const size_t len = strcspn(cp, ",");
+        if (len == 0 || len >= sizeof(num) || nwidths_opt == PARDIFF_MAX_WIDTHS) return -1;
+        memcpy(num, cp, len);
+        num[len] = '\0';
+        const int width = parse_count(num);
+        if (width <= 0) return -1;
+        widths_opt[nwidths_opt++] = width;
+        if (cp[len] == '\0') break;
+        cp += len + 1;
+    }
+    return widths_opt[0];
+}
+
+#ifndef PARDIFF_IS_DOS
+static long long
+parse_size(const char *str)
+{
+    char *end = NULL;
+    long long size = strtoll(str, &end, 10);
+    if (end == str || size < 0) return -1;
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;   /* fall through */
+    case 'M': case 'm': size *= 1024;   /* fall through */
+    case 'K': case 'k': size *= 1024; ++end; break;
+    default: break;
+    }
+    return (*end == '\0') ? size : -1;
+}
+#endif
+
+/*
+ * Parse the options in argv starting at *argi, leaving *argi on the
+ * first operand.  Returns -1 to carry on, or else the exit code.
+ */
+static int
+parse_options(const char *prog, int argc, char *argv[], int *argi)
+{
+    for (; *argi < argc; ++*argi)
     {
-        const char *const arg = argv[argi];
+        const char *const arg = argv[*argi];
         if (arg[0] != '-' || arg[1] == '\0') break;
         if (arg[1] == 'w') {
             const char *width_arg = NULL;
             if (arg[2] == '\0') {
-                if (++argi >= argc) {
+                if (++*argi >= argc) {
                     return pardiff_usage(prog); /* missing width argument */
                 }
-                width_arg = argv[argi];
+                width_arg = argv[*argi];
             }
             else {
                 width_arg = arg + 2;
             }
-            const char *cp = width_arg;
-            while (isdigit((int)*cp)) ++cp;
-            int width = (cp > width_arg && *cp == '\0') ? atoi(width_arg) : -1;
+            const int width = parse_widths(width_arg);
             if (width <= 0) {
                 return pardiff_usage(prog); /* invalid width argument */
             }
             width_opt = width;
         }
+#ifndef PARDIFF_IS_DOS
+        else if (arg[1] == 'o') {
+            if (arg[2] == '\0') {
+                if (++*argi >= argc) {
+                    return pardiff_usage(prog); /* missing output file */
+                }
+                output_opt = argv[*argi];
+            }
+            else {
+                output_opt = arg + 2;
+            }
+        }
+#endif
         else if (arg[1] == '-' && arg[2] == '\0') {
-            ++argi;
+            ++*argi;
             break;
         }
+        else if (arg[1] == '-') {
+            const char *val = NULL;
+            int match = 0;
+            if (strcmp(arg + 2, "summary") == 0) {
+                pardiff_summary_set(1);
+                match = 1;
+            }
+            else if (strcmp(arg + 2, "collapse-duplicates") == 0) {
+                pardiff_memo_set(PARDIFF_MEMO_COLLAPSE);
+                match = 1;
+            }
+            else if (strcmp(arg + 2, "context-from") == 0) {
+                if (*argi + 2 >= argc) {
+                    return pardiff_usage(prog); /* two files to take lines from */
+                }
+                source_opt[0] = argv[++*argi];
+                source_opt[1] = argv[++*argi];
+                match = 1;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "context-lines", &val)) > 0) {
+                const int lines = parse_count(val);
+                if (lines < 0) {
+                    return pardiff_usage(prog); /* invalid line count */
+                }
+                pardiff_source_set_lines(lines);
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "input-encoding", &val)) > 0) {
+                const int enc = pardiff_encoding_parse(val);
+                if (enc < 0) {
+                    return pardiff_usage(prog); /* unknown encoding */
+                }
+                pardiff_set_input_encoding(enc);
+            }
+            else if (strcmp(arg + 2, "from-model") == 0) {
+                from_model_opt = 1;
+                match = 1;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "save-model", &val)) > 0) {
+                save_model_opt = val;
+            }
+            else if (strcmp(arg + 2, "ignore-blank-lines") == 0) {
+                pardiff_filter_set_ignore_blank();
+                match = 1;
+            }
+            else if (strcmp(arg + 2, "ignore-whitespace") == 0) {
+                pardiff_filter_set_ignore_space();
+                match = 1;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "type", &val)) > 0) {
+                if (pardiff_filter_set_types(val) != 0) {
+                    return pardiff_usage(prog); /* invalid hunk types */
+                }
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "lines", &val)) > 0) {
+                if (pardiff_filter_set_lines(val) != 0) {
+                    return pardiff_usage(prog); /* invalid line range */
+                }
+            }
+#ifndef PARDIFF_IS_DOS
+            else if ((match = long_opt_value(argc, argv, argi, "path", &val)) > 0) {
+                pardiff_filter_set_path(val);
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "grep", &val)) > 0) {
+                if (pardiff_filter_set_grep(val) != 0) {
+                    fprintf(stderr, "%s: invalid regular expression: %s\n", prog, val);
+                    return 1;
+                }
+            }
+            else if (strcmp(arg + 2, "watch") == 0) {
+                watch_opt = 1;
+                match = 1;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "checkpoint-interval", &val)) > 0) {
+                checkpoint_every_opt = parse_size(val);
+                if (checkpoint_every_opt <= 0) {
+                    return pardiff_usage(prog); /* invalid interval */
+                }
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "checkpoint", &val)) > 0) {
+                checkpoint_opt = val;
+            }
+            else if (strcmp(arg + 2, "resume") == 0) {
+                resume_opt = 1;
+                match = 1;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "serve", &val)) > 0) {
+                serve_opt = val;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "connect", &val)) > 0) {
+                connect_opt = val;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "workers", &val)) > 0) {
+                workers_opt = parse_count(val);
+                if (workers_opt <= 0) {
+                    return pardiff_usage(prog); /* invalid worker count */
+                }
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "cache", &val)) > 0) {
+                cache_opt = val;
+            }
+            else if ((match = long_opt_value(argc, argv, argi, "cache-size", &val)) > 0) {
+                cache_size_opt = parse_size(val);
+                if (cache_size_opt < 0) {
+                    return pardiff_usage(prog); /* invalid cache size */
+                }
+            }
+#endif
+            if (match <= 0) {
+                return pardiff_usage(prog); /* unknown or incomplete */
+            }
+        }
         else {
             const char* ap = arg;
             while (*++ap) {
@@ -504,28 +2115,323 @@ main(int argc, char *argv[])
             }
         }
     }
+    return -1;
+}
+
+/*
+ * Render one request for the server: argv holds the options only and
+ * fp the diff to convert.  Everything a previous request may have set
+ * is put back to its default first.
+ */
+int
+pardiff_request(const char *prog, int argc, char *argv[], FILE *fp)
+{
+    width_opt = -1;
+    nwidths_opt = 0;
+    context_mode = 0;
+    save_model_opt = NULL;
+    from_model_opt = 0;
+    source_opt[0] = source_opt[1] = NULL;
+    pardiff_source_set_lines(PARDIFF_DFLT_CONTEXT_LINES);
+    pardiff_set_input_encoding(PARDIFF_ENC_AUTO);
+    pardiff_filter_reset();
+    pardiff_summary_set(0);
+    pardiff_memo_set(PARDIFF_MEMO_AUTO);
+#ifndef PARDIFF_IS_DOS
+    serve_opt = NULL;
+    connect_opt = NULL;
+    cache_opt = NULL;
+    watch_opt = 0;
+    checkpoint_opt = NULL;
+    resume_opt = 0;
+    output_opt = NULL;
+#endif
+
+    int argi = 1;
+    const int rc = parse_options(prog, argc, argv, &argi);
+    if (rc >= 0) return rc;
+#ifndef PARDIFF_IS_DOS
+    if (serve_opt || connect_opt || cache_opt || watch_opt || checkpoint_opt || resume_opt
+        || output_opt || argi < argc) {
+        fprintf(stderr, "%s: invalid request\n", prog);
+        return 1;
+    }
+#endif
+    if (save_model_opt || source_opt[0] || (context_mode && model_wanted())) {
+        fprintf(stderr, "%s: invalid request\n", prog);
+        return 1;
+    }
+    if (model_wanted()) {
+        return do_model(prog, fp);
+    }
+
+    return context_mode
+        ? pardiff_context_main(prog, fp)
+        : pardiff_main(prog, fp);
+}
+
+#ifndef PARDIFF_IS_DOS
+/*
+ * Send the input to a pardiff server.  The options given on the command
+ * line are passed along, except the ones that only make sense here.
+ */
+static int
+do_connect(const char *prog, int argc, char *argv[], int argi)
+{
+    char width_arg[32];
+    char **args = (char **)malloc(sizeof(char *) * ((size_t)argc + 1));
+    if (!args) abort();
+
+    int nargs = 0;
+    for (int i = 1; i < argi; ++i) {
+        const char *const arg = argv[i];
+        if (strcmp(arg, "--") == 0) break;
+        if (strcmp(arg, "--connect") == 0) {
+            ++i;
+            continue;
+        }
+        if (strncmp(arg, "--connect=", 10) == 0) continue;
+        args[nargs++] = argv[i];
+    }
+    if (width_opt <= 0) {
+        /* the server has no terminal to ask */
+        snprintf(width_arg, sizeof(width_arg), "-w%d", get_term_width());
+        args[nargs++] = width_arg;
+    }
+    args[nargs] = NULL;
+
+    int rc = 1;
+    if (argi + 1 < argc) {
+        rc = pardiff_usage(prog); /* one input per request */
+    }
+    else if (argi == argc || strcmp(argv[argi], "-") == 0) {
+        rc = pardiff_client_main(prog, connect_opt, nargs, args, STDIN_FILENO);
+    }
+    else {
+        const int fd = open(argv[argi], O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+        }
+        else {
+            rc = pardiff_client_main(prog, connect_opt, nargs, args, fd);
+            close(fd);
+        }
+    }
+
+    free(args);
+    return rc;
+}
+
+/*
+ * Check that a render can be checkpointed, and on --resume, cut the
+ * output back to what the checkpoint covers.  Returns -1 to carry on,
+ * or else the exit code.
+ */
+static int
+start_checkpoints(const char *prog, int operands, char *names[])
+{
+    if (resume_opt && !checkpoint_opt) {
+        return pardiff_usage(prog); /* nothing to resume from */
+    }
+    if (!checkpoint_opt) return -1;
+    if (context_mode || model_wanted() || pardiff_summary_active() || cache_opt
+        || pardiff_memo_mode() == PARDIFF_MEMO_COLLAPSE) {
+        return pardiff_usage(prog); /* only of plain normal diff renders */
+    }
+    if (lseek(STDOUT_FILENO, 0, SEEK_CUR) < 0) {
+        fprintf(stderr, "%s: checkpoints need the output in a file\n", prog);
+        return 1;
+    }
+    memset(&ckpt_resume, 0, sizeof(ckpt_resume));
+    if (!resume_opt) return -1;
+
+    const int rc = pardiff_checkpoint_load(checkpoint_opt, &ckpt_resume);
+    if (rc < 0) {
+        fprintf(stderr, "%s: %s: not a checkpoint\n", prog, checkpoint_opt);
+        return 1;
+    }
+    if (rc == 0) {
+        char key[sizeof(ckpt_resume.key)];
+        checkpoint_key(key, sizeof(key));
+        if (strcmp(key, ckpt_resume.key) != 0 || ckpt_resume.state != psNeedCmd
+            || ckpt_resume.operand >= operands) {
+            fprintf(stderr, "%s: %s: checkpoint of another render\n", prog, checkpoint_opt);
+            return 1;
+        }
+
+        /* the output so far must be of the input that is read on in */
+        const char *const name = names ? names[ckpt_resume.operand] : "-";
+        struct stat in_st;
+        const int stat_rc = (strcmp(name, "-") == 0) ? fstat(STDIN_FILENO, &in_st)
+                                                     : stat(name, &in_st);
+        if (stat_rc != 0) {
+            perror(name);
+            return 1;
+        }
+        pardiff_checkpoint_t now;
+        input_identity(name, &in_st, &now);
+        if (strcmp(now.in_name, ckpt_resume.in_name) != 0 || now.in_size != ckpt_resume.in_size
+            || now.in_mtime != ckpt_resume.in_mtime || now.in_dev != ckpt_resume.in_dev
+            || now.in_ino != ckpt_resume.in_ino) {
+            fprintf(stderr, "%s: %s: checkpoint of another input than %s\n",
+                    prog, checkpoint_opt, name);
+            return 1;
+        }
+        ckpt_resuming = 1;
+    }
+
+    /* with no checkpoint yet, the render starts over */
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) != 0 || st.st_size < ckpt_resume.out_offset) {
+        fprintf(stderr, "%s: the output is shorter than the checkpoint\n", prog);
+        return 1;
+    }
+    if (ftruncate(STDOUT_FILENO, (off_t)ckpt_resume.out_offset) != 0
+        || lseek(STDOUT_FILENO, (off_t)ckpt_resume.out_offset, SEEK_SET) < 0) {
+        perror("ftruncate");
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * A render that got to the end needs its checkpoint no more.
+ */
+static int
+end_checkpoints(int rc)
+{
+    if (checkpoint_opt && rc == 0 && unlink(checkpoint_opt) != 0 && errno != ENOENT) {
+        perror(checkpoint_opt);
+    }
+    return rc;
+}
+#endif
+
+/*
+ * Main routine
+ */
+int
+main(int argc, char *argv[])
+{
+    const char *const prog = argv[0];
+
+    int argi = 1;
+    const int opt_rc = parse_options(prog, argc, argv, &argi);
+    if (opt_rc >= 0) return opt_rc;
+    if (context_mode && model_wanted()) {
+        return pardiff_usage(prog); /* models are of normal diffs */
+    }
+    if (save_model_opt && argi + 1 < argc) {
+        return pardiff_usage(prog); /* one input per model */
+    }
+    if (source_opt[0]) {
+        if (context_mode) {
+            return pardiff_usage(prog); /* context diffs have their own */
+        }
+        if (pardiff_source_open(source_opt[0], source_opt[1]) != 0) {
+            return 1;
+        }
+    }
+
+#ifndef PARDIFF_IS_DOS
+    if (output_opt) {
+        if (serve_opt || connect_opt) {
+            return pardiff_usage(prog); /* the output goes to the client */
+        }
+        if (pardiff_output_open(output_opt, resume_opt) != 0) {
+            return 1;
+        }
+    }
+    if (serve_opt) {
+        if (connect_opt || argi < argc) {
+            return pardiff_usage(prog); /* server takes no input */
+        }
+        return pardiff_serve_main(prog, serve_opt, workers_opt);
+    }
+    if (connect_opt) {
+        return do_connect(prog, argc, argv, argi);
+    }
+    if (watch_opt) {
+        if (context_mode || argi + 2 != argc) {
+            return pardiff_usage(prog); /* two files to compare */
+        }
+        return pardiff_watch_main(prog, argv[argi], argv[argi + 1], pardiff_main);
+    }
+
+    const int ckpt_rc = start_checkpoints(prog, argi < argc ? argc - argi : 1,
+                                          argi < argc ? argv + argi : NULL);
+    if (ckpt_rc >= 0) return ckpt_rc;
+
+    /* a file takes the output in large writes; a pager gets stdio's usual blocks */
+    struct stat out_st;
+    if (fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode)) {
+        setvbuf(stdout, NULL, _IOFBF, PARDIFF_IO_BUF_SIZE);
+    }
 
     if (argi >= argc) {
-        return do_pardiff(prog, NULL, context_mode);
+        return end_checkpoints(do_pardiff(prog, stdin, context_mode));
+    }
+#else
+    if (argi >= argc) {
+        return do_pardiff(prog, stdin, context_mode);
     }
+#endif
 
     const int m = (argi + 1) < argc;
+    const int first = argi;
     int rc = 0;
     int stdin_done = 0;
+    prefetch_t ahead[PARDIFF_PREFETCH_FILES];
+    int argi_ahead = argi;
+#ifdef PARDIFF_IO_URING
+    uring_on = m && pardiff_uring_open() == 0;
+#endif
     for (; argi < argc; ++argi) {
+        for (; argi_ahead < argc && argi_ahead < argi + PARDIFF_PREFETCH_FILES; ++argi_ahead) {
+            const int slot = argi_ahead % PARDIFF_PREFETCH_FILES;
+            prefetch_input(&ahead[slot], slot, argv[argi_ahead]);
+        }
+        prefetch_t *const pf = &ahead[argi % PARDIFF_PREFETCH_FILES];
+        prefetch_take(pf, argi % PARDIFF_PREFETCH_FILES);
+
         const char *const fn = argv[argi];
         if (*fn == '\0') continue;
         const int do_stdin = (fn[0] == '-' && fn[1] == '\0');
         if (do_stdin && stdin_done) continue;
-        if (m) {
+        int header = m;
+#ifndef PARDIFF_IS_DOS
+        ckpt_operand = argi - first;
+        ckpt_name = fn;
+        if (ckpt_operand < ckpt_resume.operand) {
+            /* all in the output already */
+            if (pf->fp && pf->fp != stdin) fclose(pf->fp);
+            if (do_stdin) stdin_done = 1;
+            continue;
+        }
+        if (ckpt_resuming) header = 0;
+#endif
+        if (header) {
             if (do_stdin) printf("stdin:\n");
             else printf("file: %s\n", fn);
         }
-        const int do_rc = do_pardiff(prog, fn, context_mode);
+        int do_rc = -1;
+        if (pf->fp) {
+            do_rc = do_pardiff(prog, pf->fp, context_mode);
+        } else {
+            errno = pf->err;
+            perror("fopen");
+        }
+#ifndef PARDIFF_IS_DOS
+        ckpt_resuming = 0;
+#endif
         if (do_stdin) stdin_done = 1;
         if (rc == 0) rc = do_rc;
         if (m && (argi + 1) < argc) putchar('\n');
     }
 
+#ifndef PARDIFF_IS_DOS
+    return end_checkpoints(rc);
+#else
     return rc;
+#endif
 }
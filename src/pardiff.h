@@ -19,6 +19,11 @@
 
 #define _GNU_SOURCE
 
+/* 64-bit file offsets on 32-bit systems too */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #else
@@ -30,11 +35,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 #if !defined(__MSDOS__) && !defined(_WIN32)
 /* include files to determine the width of the output terminal */
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <unistd.h>
 #if defined __NetBSD__ || defined __FreeBSD__ || defined __OpenBSD__ || defined __APPLE__
 #include <sys/ttycom.h>
 #else
@@ -49,9 +56,50 @@
 #define  PARDIFF_IS_DOS
 #endif
 
+/*
+ * Static tracepoints for bpftrace and perf, compiled in only with
+ * configure --enable-sdt.  A probe that is not attached is a nop.
+ */
+#ifdef PARDIFF_SDT
+#include <sys/sdt.h>
+#define PARDIFF_PROBE(name)                     DTRACE_PROBE(pardiff, name)
+#define PARDIFF_PROBE2(name, a, b)              DTRACE_PROBE2(pardiff, name, a, b)
+#define PARDIFF_PROBE6(name, a, b, c, d, e, f)  DTRACE_PROBE6(pardiff, name, a, b, c, d, e, f)
+#else
+#define PARDIFF_PROBE(name)                     ((void)0)
+#define PARDIFF_PROBE2(name, a, b)              ((void)0)
+#define PARDIFF_PROBE6(name, a, b, c, d, e, f)  ((void)0)
+#endif
+
 /* buffer to hold one line (similar to max size for vi) */
 #define PARDIFF_LINE_BUF_SIZE 2048
 
+/* stdio buffer for input files and for output that is not a terminal */
+#define PARDIFF_IO_BUF_SIZE (256 * 1024)
+
+/* how many input files are opened and read ahead of the current one */
+#define PARDIFF_PREFETCH_FILES 16
+#define PARDIFF_PREFETCH_BYTES (4 * 1024 * 1024)
+
+/* line number fields are at least this many digits wide */
+#define PARDIFF_MIN_NUM_WID 5
+
+/*
+ * A line is binary data when at least one byte in this many is NUL, and
+ * it holds at least this many NULs: a single stray one is only escaped.
+ */
+#define PARDIFF_BINARY_NUL_RATIO 32
+#define PARDIFF_BINARY_MIN_NULS 2
+
+/* shown in the last column of a line too long to be read in full */
+#define PARDIFF_CLIP_MARK '>'
+
+/* lines of context shown from the source files */
+#define PARDIFF_DFLT_CONTEXT_LINES 3
+
+/* most widths one run renders the same input at */
+#define PARDIFF_MAX_WIDTHS 16
+
 /* output width size if ioctl fails */
 #ifdef __MSDOS__
 #define PARDIFF_DFLT_TERM_WID 80
@@ -59,6 +107,194 @@
 #define PARDIFF_DFLT_TERM_WID 120
 #endif
 
+/* output cache size limit if none is given */
+#define PARDIFF_DFLT_CACHE_SIZE (256LL * 1024 * 1024)
+
+/* input read between checkpoints if no interval is given */
+#define PARDIFF_DFLT_CHECKPOINT_BYTES (64LL * 1024 * 1024)
+
+/* with -o, output rendered by each process at least, and most processes */
+#define PARDIFF_SPLIT_BYTES (4LL * 1024 * 1024)
+#define PARDIFF_SPLIT_MAX_PARTS 64
+
+/* rendered hunks kept for repeats, and the largest hunk worth keeping */
+#define PARDIFF_MEMO_BYTES (32 * 1024 * 1024)
+#define PARDIFF_MEMO_HUNK_MAX (256 * 1024)
+
+/* when repeated hunks are looked for, and how they are shown */
+#define PARDIFF_MEMO_OFF      0
+#define PARDIFF_MEMO_AUTO     1     /* once the input names several files */
+#define PARDIFF_MEMO_COLLAPSE 2     /* always, as a reference to the first */
+#define PARDIFF_MEMO_HASH_INIT 0xcbf29ce484222325ULL
+
+/* input encodings, transcoded to UTF-8 as the input is read */
+#define PARDIFF_ENC_AUTO    0   /* guessed from the start of the input */
+#define PARDIFF_ENC_UTF8    1
+#define PARDIFF_ENC_UTF16LE 2
+#define PARDIFF_ENC_UTF16BE 3
+#define PARDIFF_ENC_LATIN1  4
+
+/* bytes of input the guess of its encoding would like to see */
+#define PARDIFF_ENC_DETECT_MIN 32
+
+/*
+ * Buffered line reader over a stdio stream
+ */
+typedef struct _pardiff_reader_t {
+    FILE      *fp;
+    int        fd;          /* read directly if fp is a pipe, tty or socket */
+    char      *buf;
+    size_t     size;
+    size_t     pos;         /* start of the next line in buf */
+    size_t     end;         /* end of valid data in buf */
+    size_t     held_pos;    /* where the current line was terminated */
+    char       held;        /* the byte that was there */
+    int        eof;
+    int        clipped;     /* the current line was cut short */
+    long long  offset;      /* input bytes consumed so far */
+    long long  base;        /* where in the input offset 0 is */
+    int        encoding;    /* of the input, or AUTO before the first read */
+    int        started;     /* the first read has been looked at */
+    char      *raw;         /* input still to be transcoded */
+    size_t     raw_len;
+    int        raw_eof;
+} pardiff_reader_t;
+
+extern void   pardiff_reader_init(pardiff_reader_t *rd, FILE *fp);
+extern void   pardiff_reader_free(pardiff_reader_t *rd);
+extern char  *pardiff_read_line(pardiff_reader_t *rd, size_t *len);
+extern long long pardiff_skip_lines(pardiff_reader_t *rd, long long count);
+extern long long pardiff_reader_tell(pardiff_reader_t *rd);
+extern size_t pardiff_line_starts(const char *buf, size_t len, size_t base, size_t *starts);
+
+/*
+ * Input encodings
+ */
+extern int    pardiff_encoding_parse(const char *name);
+extern void   pardiff_set_input_encoding(int enc);
+extern int    pardiff_input_encoding(void);
+extern int    pardiff_encoding_detect(const char *buf, size_t len, size_t *bom_len);
+extern size_t pardiff_transcode(int enc, const char *in, size_t len, size_t *used,
+                                char *out, int eof);
+
+/*
+ * Source files of a normal diff, for context lines
+ */
+extern int  pardiff_source_open(const char *name1, const char *name2);
+extern int  pardiff_source_active(void);
+extern void pardiff_source_set_lines(int lines);
+extern int  pardiff_source_lines(void);
+extern const char *pardiff_source_line(int side, long long n, size_t *len);
+
+/* what is known of a line of hunk text */
+#define PARDIFF_LINE_CLIPPED  0x01  /* the reader kept only the start of it */
+#define PARDIFF_LINE_MEASURED 0x02  /* the two below have been worked out */
+#define PARDIFF_LINE_BINARY   0x04
+#define PARDIFF_LINE_PLAIN    0x08  /* shown as it is, up to its newline */
+
+/* how much of a hunk a model holds */
+#define PARDIFF_HUNK_WHOLE 0x00
+#define PARDIFF_HUNK_CUT   0x01     /* the input ended part way through it */
+#define PARDIFF_HUNK_OPEN  0x02     /* its numbers never close it, the
+                                     * renderer reads on to the end */
+#define PARDIFF_HUNK_TAIL  0x04     /* the input from the first open hunk on */
+
+/*
+ * A parsed hunk: the numbers of its command line and its raw text, with
+ * where each line ends and what is known of it.  A cmd of 0 holds a
+ * "diff" line of a recursive diff in text, or the tail of the input.
+ */
+typedef struct _pardiff_hunk_t {
+    char          cmd;
+    long long     x1;
+    long long     x2;
+    long long     y1;
+    long long     y2;
+    const char   *text;
+    size_t        len;
+    const size_t *ends;
+    const char   *flags;        /* PARDIFF_LINE_* of each line */
+    size_t        lines;
+    int           kind;         /* PARDIFF_HUNK_* */
+    size_t        tail;         /* open: line of the tail after its command */
+} pardiff_hunk_t;
+
+/*
+ * Parsed diff model, to be rendered at any width
+ */
+typedef struct _pardiff_model_t {
+    char   *buf;
+    size_t  len;
+    size_t  size;
+    size_t  tail;               /* where the tail record is, 0 if none */
+} pardiff_model_t;
+
+extern void   pardiff_model_init(pardiff_model_t *m);
+extern void   pardiff_model_free(pardiff_model_t *m);
+extern void   pardiff_model_add(pardiff_model_t *m, const pardiff_hunk_t *h);
+extern size_t pardiff_model_start(void);
+extern int    pardiff_model_next(const pardiff_model_t *m, size_t *pos, pardiff_hunk_t *h);
+extern int    pardiff_model_save(const pardiff_model_t *m, const char *path);
+extern int    pardiff_model_load(pardiff_model_t *m, FILE *fp);
+extern int    pardiff_model_tail(const pardiff_model_t *m, pardiff_hunk_t *h);
+
+/*
+ * Byte classification for rendering
+ */
+extern size_t pardiff_plain_run(const char *str, size_t len);
+extern int    pardiff_is_binary(const char *str, size_t len);
+extern int    pardiff_measure_line(const char *line, size_t len);
+
+/*
+ * Hunk selection
+ */
+extern void pardiff_filter_reset(void);
+extern int  pardiff_filter_set_types(const char *types);
+extern int  pardiff_filter_set_lines(const char *range);
+extern void pardiff_filter_set_ignore_blank(void);
+extern void pardiff_filter_set_ignore_space(void);
+#ifndef PARDIFF_IS_DOS
+extern int  pardiff_filter_set_path(const char *glob);
+extern int  pardiff_filter_set_grep(const char *pattern);
+#endif
+extern int  pardiff_filter_active(void);
+extern int  pardiff_filter_text_active(void);
+extern void pardiff_filter_key(char *buf, size_t size);
+extern int  pardiff_filter_file(const char *line, size_t len);
+extern int  pardiff_filter_hunk(char cmd, long long x1, long long x2,
+                                long long y1, long long y2);
+extern void pardiff_filter_text_begin(void);
+extern void pardiff_filter_text_line(int side, const char *line, size_t len);
+extern int  pardiff_filter_text_end(void);
+
+/*
+ * Summary mode
+ */
+extern void pardiff_summary_set(int on);
+extern int  pardiff_summary_active(void);
+extern void pardiff_summary_begin(void);
+extern void pardiff_summary_file(const char *name, size_t len);
+extern void pardiff_summary_diff_line(const char *line, size_t len);
+extern void pardiff_summary_hunk(long long added, long long deleted,
+                                 long long changed_old, long long changed_new);
+extern void pardiff_summary_end(void);
+
+/*
+ * Memo of rendered hunks, and output that can be captured for it
+ */
+extern void pardiff_memo_set(int mode);
+extern int  pardiff_memo_mode(void);
+extern void pardiff_memo_reset(void);
+extern unsigned long long pardiff_memo_hash(unsigned long long h, const void *data, size_t len);
+extern void pardiff_memo_key_begin(void);
+extern void pardiff_memo_key_add(const void *data, size_t len);
+extern const char *pardiff_memo_find(void);
+extern void pardiff_memo_write(void);
+extern void pardiff_memo_capture(void);
+extern void pardiff_memo_store(const char *label);
+extern void pardiff_out_write(const char *str, size_t len);
+extern void pardiff_out_fill(char c, int n);
+
 /*
  * Context diff filter
  */
@@ -66,4 +302,76 @@ extern int pardiff_context_main(const char *prog, FILE *fp);
 
 extern int get_term_width(void);
 
+/*
+ * Render one server request (options in argv, diff on fp) to stdout
+ */
+extern int pardiff_request(const char *prog, int argc, char *argv[], FILE *fp);
+
+#ifndef PARDIFF_IS_DOS
+/*
+ * Persistent server and its thin client
+ */
+extern int pardiff_serve_main(const char *prog, const char *path, int workers);
+extern int pardiff_client_main(const char *prog, const char *path,
+                               int nargs, char *args[], int in_fd);
+
+/*
+ * Output cache: render fp through render, or replay the stored result
+ */
+extern int pardiff_cache_render(const char *prog, const char *dir, long long limit,
+                                const char *opts, FILE *fp,
+                                int (*render)(const char *prog, FILE *fp));
+
+/*
+ * Watch mode: compare two files and redraw the hunks each edit changes
+ */
+extern int pardiff_watch_main(const char *prog, const char *name1, const char *name2,
+                              int (*render)(const char *prog, FILE *fp));
+
+/*
+ * Checkpoint of a render, taken between hunks of a normal diff
+ */
+typedef struct _pardiff_checkpoint_t {
+    char      key[PARDIFF_LINE_BUF_SIZE];   /* options the output depends on */
+    int       operand;      /* input of the command line being read */
+    char      in_name[PARDIFF_LINE_BUF_SIZE];   /* as it was named, "-" for stdin */
+    long long in_size;      /* what was open under that name */
+    long long in_mtime;
+    long long in_dev;
+    long long in_ino;
+    long long in_offset;    /* where in it the next line starts */
+    long long out_offset;   /* output written up to here */
+    int       state;        /* of the parser */
+    int       num_wid;
+    int       got_input;
+    int       memo;
+    long long ctx_seen;     /* context lines shown and owed */
+    long long ctx_after[2];
+    long long ctx_after_n;
+    char      file_line[PARDIFF_LINE_BUF_SIZE]; /* "diff" line of the file, if any */
+    size_t    file_len;
+} pardiff_checkpoint_t;
+
+extern int pardiff_checkpoint_save(const char *path, const pardiff_checkpoint_t *cp);
+extern int pardiff_checkpoint_load(const char *path, pardiff_checkpoint_t *cp);
+
+/*
+ * Output to a file, rendered in parts by several processes at once
+ */
+extern int pardiff_output_open(const char *path, int keep);
+extern int pardiff_output_parts(const char *prog, const char *path, int parts,
+                                const long long *offsets, long long size,
+                                int (*render)(const char *prog, int part));
+
+#ifdef PARDIFF_IO_URING
+/*
+ * io_uring backend opening the input files coming up and starting their
+ * readahead
+ */
+extern int   pardiff_uring_open(void);
+extern void  pardiff_uring_prefetch(int slot, const char *fn);
+extern FILE *pardiff_uring_take(int slot, int *err);
+#endif
+#endif
+
 #endif // !def _PARDIFF_H_
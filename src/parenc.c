@@ -0,0 +1,304 @@
+/***************************************************************************
+ * parenc.c                                                                *
+ *                                                                         *
+ * Input encodings.  Diffs of UTF-16 and Latin-1 files are transcoded to   *
+ * UTF-8 as the reader takes them in, so the parsers only ever see bytes   *
+ * that ASCII digits and tags can be matched in.  ASCII, which is nearly   *
+ * all of a diff, goes through 16 bytes at a time.                         *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PARDIFF_HAVE_SSE2
+#endif
+
+/* how much of the start of the input the guess looks at */
+#define DETECT_BYTES (64 * 1024)
+#define DETECT_UNITS (PARDIFF_ENC_DETECT_MIN / 2)
+
+/* Latin-1 has more than this many bytes that are not UTF-8 to each
+ * sequence that is, which is then there by chance */
+#define DETECT_LATIN1_RATIO 4
+
+#define REPLACEMENT_CHAR 0xfffd
+
+static int input_encoding = PARDIFF_ENC_AUTO;
+
+static const struct {
+    const char *name;
+    int         enc;
+} enc_names[] = {
+    { "auto",       PARDIFF_ENC_AUTO },
+    { "utf-8",      PARDIFF_ENC_UTF8 },
+    { "utf8",       PARDIFF_ENC_UTF8 },
+    { "utf-16",     PARDIFF_ENC_UTF16LE },
+    { "utf-16le",   PARDIFF_ENC_UTF16LE },
+    { "utf-16be",   PARDIFF_ENC_UTF16BE },
+    { "latin1",     PARDIFF_ENC_LATIN1 },
+    { "latin-1",    PARDIFF_ENC_LATIN1 },
+    { "iso-8859-1", PARDIFF_ENC_LATIN1 },
+};
+
+/*
+ * Encoding named by an --input-encoding value, in any case, or -1.
+ */
+int
+pardiff_encoding_parse(const char *name)
+{
+    char lower[16];
+    size_t len = strlen(name);
+    if (len >= sizeof(lower)) return -1;
+    for (size_t i = 0; i <= len; ++i) {
+        lower[i] = (char)tolower((unsigned char)name[i]);
+    }
+    for (size_t i = 0; i < sizeof(enc_names) / sizeof(enc_names[0]); ++i) {
+        if (strcmp(lower, enc_names[i].name) == 0) return enc_names[i].enc;
+    }
+    return -1;
+}
+
+void
+pardiff_set_input_encoding(int enc)
+{
+    input_encoding = enc;
+}
+
+int
+pardiff_input_encoding(void)
+{
+    return input_encoding;
+}
+
+/*
+ * Count the multibyte UTF-8 sequences in buf, and the bytes above 0x7f
+ * that are not part of one.  A sequence cut short by the end of buf is
+ * neither.
+ */
+static void
+count_utf8(const unsigned char *buf, size_t len, size_t *good, size_t *bad)
+{
+    size_t i = 0;
+
+    *good = *bad = 0;
+    while (i < len) {
+        const unsigned char c = buf[i];
+        size_t more = 0;
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        if (c >= 0xc2 && c < 0xe0)      more = 1;
+        else if (c >= 0xe0 && c < 0xf0) more = 2;
+        else if (c >= 0xf0 && c < 0xf5) more = 3;
+        size_t n = 0;
+        while (n < more && i + 1 + n < len && (buf[i + 1 + n] & 0xc0) == 0x80) ++n;
+        if (more > 0 && n == more) {
+            ++*good;
+            i += 1 + more;
+        } else if (more > 0 && i + 1 + n == len) {
+            break;
+        } else {
+            ++*bad;
+            ++i;
+        }
+    }
+}
+
+/*
+ * Guess the encoding from the start of the input.  A byte order mark
+ * settles it, and its length is left in *bom_len.  Otherwise a diff
+ * starts with ASCII digits or tags, so UTF-16 shows as every other byte
+ * being NUL.  Text with bytes above 0x7f, and no NUL bytes of binary
+ * data, is taken for Latin-1 when hardly any of those bytes make UTF-8:
+ * a few stray bytes in a diff that is mostly UTF-8 are passed through
+ * rather than have every real character turned into two.
+ */
+int
+pardiff_encoding_detect(const char *buf, size_t len, size_t *bom_len)
+{
+    const unsigned char *const ub = (const unsigned char *)buf;
+
+    *bom_len = 0;
+    if (len >= 3 && ub[0] == 0xef && ub[1] == 0xbb && ub[2] == 0xbf) {
+        *bom_len = 3;
+        return PARDIFF_ENC_UTF8;
+    }
+    if (len >= 2 && ub[0] == 0xff && ub[1] == 0xfe) {
+        *bom_len = 2;
+        return PARDIFF_ENC_UTF16LE;
+    }
+    if (len >= 2 && ub[0] == 0xfe && ub[1] == 0xff) {
+        *bom_len = 2;
+        return PARDIFF_ENC_UTF16BE;
+    }
+
+    /* a short first line from a pipe is all there may be to go on */
+    const size_t units = len / 2 < DETECT_UNITS ? len / 2 : DETECT_UNITS;
+    if (units >= 2) {
+        int le = 1;
+        int be = 1;
+        for (size_t i = 0; i < 2 * units; i += 2) {
+            le = le && ub[i] != 0 && ub[i] < 0x80 && ub[i + 1] == 0;
+            be = be && ub[i] == 0 && ub[i + 1] != 0 && ub[i + 1] < 0x80;
+        }
+        if (le) return PARDIFF_ENC_UTF16LE;
+        if (be) return PARDIFF_ENC_UTF16BE;
+    }
+
+    const size_t n = len < DETECT_BYTES ? len : DETECT_BYTES;
+    size_t good = 0;
+    size_t bad = 0;
+    count_utf8(ub, n, &good, &bad);
+    if (bad > 0 && memchr(buf, '\0', n) == NULL && bad > good * DETECT_LATIN1_RATIO) {
+        return PARDIFF_ENC_LATIN1;
+    }
+    return PARDIFF_ENC_UTF8;
+}
+
+static char *
+put_utf8(char *out, unsigned cp)
+{
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xc0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xe0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+static size_t
+latin1_to_utf8(const unsigned char *in, size_t len, size_t *used, char *out)
+{
+    char *const out_start = out;
+    size_t i = 0;
+
+    while (i < len) {
+#ifdef PARDIFF_HAVE_SSE2
+        if (i + 16 <= len) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+            if (_mm_movemask_epi8(v) == 0) {
+                _mm_storeu_si128((__m128i *)out, v);
+                out += 16;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        const size_t block_end = i + 16 < len ? i + 16 : len;
+        for (; i < block_end; ++i) {
+            out = put_utf8(out, in[i]);
+        }
+    }
+    *used = i;
+    return (size_t)(out - out_start);
+}
+
+static size_t
+utf16_to_utf8(const unsigned char *in, size_t len, size_t *used, char *out,
+              int big_endian, int eof)
+{
+    char *const out_start = out;
+    const int hi = big_endian ? 0 : 1;
+    const int lo = big_endian ? 1 : 0;
+    size_t i = 0;
+    int pending = 0;    /* stopped at the first half of a pair */
+
+    while (i + 2 <= len && !pending) {
+#ifdef PARDIFF_HAVE_SSE2
+        if (i + 16 <= len) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+            if (big_endian) {
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            }
+            /* eight ASCII code units become eight bytes */
+            const __m128i high = _mm_and_si128(v, _mm_set1_epi16((short)0xff80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xffff) {
+                _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(v, v));
+                out += 8;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        const size_t block_end = i + 16 < len ? i + 16 : len;
+        while (i + 2 <= block_end) {
+            unsigned cp = ((unsigned)in[i + hi] << 8) | in[i + lo];
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                if (i + 4 > len && !eof) {
+                    /* the rest of the pair is still to come */
+                    pending = 1;
+                    break;
+                }
+                if (i + 4 > len) {
+                    cp = REPLACEMENT_CHAR;
+                    i += 2;
+                } else {
+                    const unsigned cp2 = ((unsigned)in[i + 2 + hi] << 8) | in[i + 2 + lo];
+                    if (cp2 >= 0xdc00 && cp2 < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (cp2 - 0xdc00);
+                        i += 4;
+                    } else {
+                        cp = REPLACEMENT_CHAR;
+                        i += 2;
+                    }
+                }
+            } else {
+                if (cp >= 0xdc00 && cp < 0xe000) cp = REPLACEMENT_CHAR;
+                i += 2;
+            }
+            out = put_utf8(out, cp);
+        }
+    }
+    if (eof && i < len) {
+        /* an odd byte at the very end */
+        out = put_utf8(out, REPLACEMENT_CHAR);
+        i = len;
+    }
+
+    *used = i;
+    return (size_t)(out - out_start);
+}
+
+/*
+ * Transcode in[0..len) to UTF-8 in out, which must have room for twice
+ * len plus 4 bytes.  Returns the bytes written; *used is how much of in
+ * was taken, which short of eof may leave the start of a character.
+ */
+size_t
+pardiff_transcode(int enc, const char *in, size_t len, size_t *used, char *out, int eof)
+{
+    const unsigned char *const uin = (const unsigned char *)in;
+
+    switch (enc) {
+        case PARDIFF_ENC_UTF16LE:
+            return utf16_to_utf8(uin, len, used, out, 0, eof);
+        case PARDIFF_ENC_UTF16BE:
+            return utf16_to_utf8(uin, len, used, out, 1, eof);
+        case PARDIFF_ENC_LATIN1:
+            return latin1_to_utf8(uin, len, used, out);
+        default:
+            memcpy(out, in, len);
+            *used = len;
+            return len;
+    }
+}
@@ -0,0 +1,303 @@
+/***************************************************************************
+ * parfilter.c                                                             *
+ *                                                                         *
+ * Hunk selection.  Filters are checked as soon as a file or hunk header   *
+ * has been parsed, so rejected hunks are skipped without being rendered.  *
+ * Filters on hunk text look at the raw lines before any formatting.       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+#include <fnmatch.h>
+#include <regex.h>
+#endif
+
+typedef struct _filter_t {
+    const char *types;          /* hunk commands to keep, NULL for all */
+    long long   from;           /* line window, 0 if not limited */
+    long long   to;
+    int         ignore_blank;
+    int         ignore_space;
+#ifndef PARDIFF_IS_DOS
+    const char *path_glob;
+    const char *grep_pat;
+    regex_t     grep_re;
+#endif
+} filter_t;
+
+static filter_t filter;
+static int file_selected = 1;
+
+/* running state of the text filters over one hunk */
+static int text_all_blank = 1;
+static int text_matched = 0;
+
+/* the changed lines of either side with their whitespace squeezed out,
+ * each ended by a newline, for --ignore-whitespace */
+static char  *text_buf[2] = { NULL, NULL };
+static size_t text_len[2] = { 0, 0 };
+static size_t text_size[2] = { 0, 0 };
+
+void
+pardiff_filter_reset(void)
+{
+#ifndef PARDIFF_IS_DOS
+    if (filter.grep_pat) {
+        regfree(&filter.grep_re);
+    }
+#endif
+    memset(&filter, 0, sizeof(filter));
+    file_selected = 1;
+}
+
+int
+pardiff_filter_set_types(const char *types)
+{
+    if (types[0] == '\0' || strspn(types, "acd") != strlen(types)) return 1;
+    filter.types = types;
+    return 0;
+}
+
+/*
+ * Line window as FROM-TO, FROM- or -TO.
+ */
+int
+pardiff_filter_set_lines(const char *range)
+{
+    char *end = NULL;
+    const char *cp = range;
+
+    filter.from = 1;
+    filter.to = -1;
+    if (*cp != '-') {
+        filter.from = strtoll(cp, &end, 10);
+        if (end == cp || filter.from <= 0) return 1;
+        cp = end;
+    }
+    if (*cp++ != '-') return 1;
+    if (*cp != '\0') {
+        filter.to = strtoll(cp, &end, 10);
+        if (end == cp || *end != '\0' || filter.to < filter.from) return 1;
+    }
+    return 0;
+}
+
+void
+pardiff_filter_set_ignore_blank(void)
+{
+    filter.ignore_blank = 1;
+}
+
+void
+pardiff_filter_set_ignore_space(void)
+{
+    filter.ignore_space = 1;
+}
+
+#ifndef PARDIFF_IS_DOS
+int
+pardiff_filter_set_path(const char *glob)
+{
+    filter.path_glob = glob;
+    return 0;
+}
+
+int
+pardiff_filter_set_grep(const char *pattern)
+{
+    if (filter.grep_pat) {
+        regfree(&filter.grep_re);
+        filter.grep_pat = NULL;
+    }
+    if (regcomp(&filter.grep_re, pattern, REG_EXTENDED | REG_NOSUB) != 0) return 1;
+    filter.grep_pat = pattern;
+    return 0;
+}
+#endif
+
+int
+pardiff_filter_active(void)
+{
+    return filter.types || filter.from || pardiff_filter_text_active()
+#ifndef PARDIFF_IS_DOS
+        || filter.path_glob
+#endif
+        ;
+}
+
+/*
+ * True if hunk text has to be seen before a hunk can be accepted.
+ */
+int
+pardiff_filter_text_active(void)
+{
+    return filter.ignore_blank || filter.ignore_space
+#ifndef PARDIFF_IS_DOS
+        || filter.grep_pat
+#endif
+        ;
+}
+
+/*
+ * Describe the filters in effect, for the output cache key.
+ */
+void
+pardiff_filter_key(char *buf, size_t size)
+{
+    snprintf(buf, size, " t=%s l=%lld-%lld B=%d W=%d",
+             filter.types ? filter.types : "", filter.from, filter.to,
+             filter.ignore_blank, filter.ignore_space);
+#ifndef PARDIFF_IS_DOS
+    const size_t len = strlen(buf);
+    snprintf(buf + len, size - len, " p=%s g=%s",
+             filter.path_glob ? filter.path_glob : "",
+             filter.grep_pat ? filter.grep_pat : "");
+#endif
+}
+
+/*
+ * A "diff [options] FILE1 FILE2" line starts another file of a
+ * recursive diff; its hunks are kept if either name matches the glob.
+ * Returns whether they are.
+ */
+int
+pardiff_filter_file(const char *line, size_t len)
+{
+#ifndef PARDIFF_IS_DOS
+    char names[2][PARDIFF_LINE_BUF_SIZE];
+    const char *words[2] = { NULL, NULL };
+    size_t lens[2] = { 0, 0 };
+
+    if (!filter.path_glob) return 1;
+
+    /* the last two words are the file names */
+    for (size_t i = 0; i < len; ) {
+        while (i < len && isspace((unsigned char)line[i])) ++i;
+        if (i == len) break;
+        const size_t start = i;
+        while (i < len && !isspace((unsigned char)line[i])) ++i;
+        words[0] = words[1];
+        lens[0] = lens[1];
+        words[1] = line + start;
+        lens[1] = i - start;
+    }
+
+    file_selected = 0;
+    for (int k = 0; k < 2 && !file_selected; ++k) {
+        if (!words[k] || lens[k] >= sizeof(names[k])) continue;
+        memcpy(names[k], words[k], lens[k]);
+        names[k][lens[k]] = '\0';
+        file_selected = fnmatch(filter.path_glob, names[k], 0) == 0;
+    }
+#else
+    (void)line;
+    (void)len;
+#endif
+    return file_selected;
+}
+
+/*
+ * Everything that can be decided from a hunk header: the current file,
+ * the command and the line ranges on either side.
+ */
+int
+pardiff_filter_hunk(char cmd, long long x1, long long x2, long long y1, long long y2)
+{
+    if (!file_selected) return 0;
+    if (filter.types && !strchr(filter.types, cmd)) return 0;
+    if (filter.from) {
+        const int old_in = x2 >= filter.from && (filter.to < 0 || x1 <= filter.to);
+        const int new_in = y2 >= filter.from && (filter.to < 0 || y1 <= filter.to);
+        if (!old_in && !new_in) return 0;
+    }
+    return 1;
+}
+
+void
+pardiff_filter_text_begin(void)
+{
+    text_all_blank = 1;
+    text_matched = 0;
+    text_len[0] = text_len[1] = 0;
+}
+
+/* room for n more bytes of the squeezed text of side */
+static char *
+text_room(int side, size_t n)
+{
+    if (text_len[side] + n > text_size[side]) {
+        text_size[side] = (text_len[side] + n) * 2;
+        char *text_buf_new = (char *)realloc(text_buf[side], text_size[side]);
+        if (!text_buf_new) abort();
+        text_buf[side] = text_buf_new;
+    }
+    return text_buf[side] + text_len[side];
+}
+
+/*
+ * Feed one changed line, side 0 for the old file and 1 for the new,
+ * without its "< ", "> " or context diff tag.
+ */
+void
+pardiff_filter_text_line(int side, const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\n') --len;
+
+    if (filter.ignore_blank && text_all_blank) {
+        for (size_t i = 0; i < len; ++i) {
+            if (!isspace((unsigned char)line[i])) {
+                text_all_blank = 0;
+                break;
+            }
+        }
+    }
+
+    if (filter.ignore_space) {
+        char *const out = text_room(side, len + 1);
+        size_t n = 0;
+        for (size_t i = 0; i < len; ++i) {
+            if (!isspace((unsigned char)line[i])) {
+                out[n++] = line[i];
+            }
+        }
+        out[n++] = '\n';
+        text_len[side] += n;
+    }
+
+#ifndef PARDIFF_IS_DOS
+    if (filter.grep_pat && !text_matched) {
+        char buf[PARDIFF_LINE_BUF_SIZE];
+        if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        text_matched = regexec(&filter.grep_re, buf, 0, NULL, 0) == 0;
+    }
+#endif
+}
+
+/*
+ * Whether the hunk fed since pardiff_filter_text_begin() is kept.  Under
+ * --ignore-whitespace it is hidden only if its two sides have as many
+ * lines and each old line equals its new one with whitespace left out,
+ * as diff -w would compare them.
+ */
+int
+pardiff_filter_text_end(void)
+{
+    if (filter.ignore_blank && text_all_blank) return 0;
+    if (filter.ignore_space && text_len[0] == text_len[1]
+        && (text_len[0] == 0 || memcmp(text_buf[0], text_buf[1], text_len[0]) == 0)) return 0;
+#ifndef PARDIFF_IS_DOS
+    if (filter.grep_pat && !text_matched) return 0;
+#endif
+    return 1;
+}
@@ -0,0 +1,492 @@
+/***************************************************************************
+ * parline.c                                                               *
+ *                                                                         *
+ * Line input and byte classification shared by the normal and context    *
+ * diff filters.                                                           *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#include <stdint.h>
+#ifndef PARDIFF_IS_DOS
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PARDIFF_HAVE_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * A stream that is not a file is read with read(2) on its descriptor,
+ * which returns what has come so far instead of waiting for a whole
+ * buffer.  It must have nothing buffered in stdio by then.
+ */
+void
+pardiff_reader_init(pardiff_reader_t *rd, FILE *fp)
+{
+    memset(rd, 0, sizeof(*rd));
+    rd->fp = fp;
+    rd->fd = -1;
+#ifndef PARDIFF_IS_DOS
+    struct stat st;
+    const int fd = fileno(fp);
+    if (fd >= 0 && fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+        rd->fd = fd;
+    }
+#endif
+    rd->size = PARDIFF_IO_BUF_SIZE;
+    /* one spare byte so a line at the very end can be terminated */
+    rd->buf = (char *)malloc(rd->size + 1);
+    if (!rd->buf) abort();
+    rd->encoding = pardiff_input_encoding();
+}
+
+void
+pardiff_reader_free(pardiff_reader_t *rd)
+{
+    free(rd->buf);
+    free(rd->raw);
+    rd->buf = NULL;
+    rd->raw = NULL;
+}
+
+/*
+ * Read up to len bytes of input, waiting only until there are some.
+ * Returns 0 at end of input.
+ */
+static size_t
+reader_read(pardiff_reader_t *rd, char *buf, size_t len)
+{
+#ifndef PARDIFF_IS_DOS
+    if (rd->fd >= 0) {
+        for (;;) {
+            const ssize_t got = read(rd->fd, buf, len);
+            if (got >= 0) return (size_t)got;
+            if (errno != EINTR) {
+                perror("read");
+                return 0;
+            }
+        }
+    }
+#endif
+    return fread(buf, 1, len, rd->fp);
+}
+
+/*
+ * Transcode raw input into the free space behind the buffered data,
+ * reading more of it as needed.  Every byte of input becomes at most
+ * two of UTF-8, and a character cut off at the end of the raw data is
+ * left there for the next time.
+ */
+static void
+reader_transcode(pardiff_reader_t *rd)
+{
+    const size_t room = rd->size - rd->end;
+    const size_t want = room > 4 ? (room - 4) / 2 : 0;
+
+    if (!rd->raw_eof && rd->raw_len < want) {
+        const size_t got = reader_read(rd, rd->raw + rd->raw_len, want - rd->raw_len);
+        rd->raw_len += got;
+        if (got == 0) {
+            rd->raw_eof = 1;
+        }
+    }
+
+    const size_t take = rd->raw_len < want ? rd->raw_len : want;
+    size_t used = 0;
+    const size_t n = pardiff_transcode(rd->encoding, rd->raw, take, &used, rd->buf + rd->end,
+                                       rd->raw_eof && take == rd->raw_len);
+    memmove(rd->raw, rd->raw + used, rd->raw_len - used);
+    rd->raw_len -= used;
+    rd->end += n;
+    if (n == 0 && rd->raw_eof && rd->raw_len == 0) {
+        rd->eof = 1;
+    }
+}
+
+/*
+ * The first read decides the encoding of the input, if it was not
+ * given.  UTF-8 is left to be read straight into the buffer from then
+ * on; anything else is moved aside to be transcoded.  A byte order mark
+ * of the encoding is dropped, given or not.  From a pipe, the guess is
+ * made as soon as there is a line or enough to go on.
+ */
+static void
+reader_start(pardiff_reader_t *rd)
+{
+    size_t got = 0;
+    for (;;) {
+        const size_t n = reader_read(rd, rd->buf + got, rd->size - got);
+        got += n;
+        if (n == 0 || got >= PARDIFF_ENC_DETECT_MIN || memchr(rd->buf, '\n', got)) break;
+    }
+    if (got == 0) {
+        rd->eof = 1;
+        return;
+    }
+
+    size_t bom = 0;
+    const int guess = pardiff_encoding_detect(rd->buf, got, &bom);
+    int enc = rd->encoding;
+    if (enc == PARDIFF_ENC_AUTO
+        || (bom && (enc == PARDIFF_ENC_UTF16LE || enc == PARDIFF_ENC_UTF16BE)
+                && (guess == PARDIFF_ENC_UTF16LE || guess == PARDIFF_ENC_UTF16BE))) {
+        /* a byte order mark also tells which UTF-16 */
+        enc = guess;
+    }
+    if (guess != enc) {
+        bom = 0;
+    }
+    rd->encoding = enc;
+
+    if (enc == PARDIFF_ENC_UTF8) {
+        memmove(rd->buf, rd->buf + bom, got - bom);
+        rd->end = got - bom;
+        rd->base += (long long)bom;
+        return;
+    }
+
+    rd->raw = (char *)malloc(rd->size);
+    if (!rd->raw) abort();
+    memcpy(rd->raw, rd->buf + bom, got - bom);
+    rd->raw_len = got - bom;
+    reader_transcode(rd);
+}
+
+/*
+ * Move the unread data to the front and read more behind it.
+ */
+static void
+reader_fill(pardiff_reader_t *rd)
+{
+    const size_t avail = rd->end - rd->pos;
+    memmove(rd->buf, rd->buf + rd->pos, avail);
+    rd->pos = 0;
+    rd->end = avail;
+
+    if (!rd->started) {
+        rd->started = 1;
+        if (rd->end == 0 && !rd->eof) {
+            reader_start(rd);
+            return;
+        }
+    }
+    if (rd->raw) {
+        reader_transcode(rd);
+        return;
+    }
+
+    const size_t got = reader_read(rd, rd->buf + rd->end, rd->size - rd->end);
+    rd->end += got;
+    if (got == 0) {
+        rd->eof = 1;
+    }
+}
+
+/*
+ * Done with the current line: put back the byte it was terminated over,
+ * and pass over the rest of it if it was clipped.
+ */
+static void
+reader_release(pardiff_reader_t *rd)
+{
+    if (rd->held_pos) {
+        rd->buf[rd->held_pos] = rd->held;
+        rd->held_pos = 0;
+    }
+    if (rd->clipped) {
+        rd->clipped = 0;
+        pardiff_skip_lines(rd, 1);
+    }
+}
+
+/*
+ * Return the next line, newline included and NUL-terminated, with its
+ * length in *len, or NULL at end of input.  The line stays valid until
+ * the next call and may be modified in place.  Embedded NUL bytes are
+ * counted in *len.
+ *
+ * Only the first PARDIFF_LINE_BUF_SIZE - 1 bytes of a longer line are
+ * returned, without a newline and with rd->clipped set; the rest of it
+ * is skipped unread, which is all a minified file or a blob on a single
+ * line is worth when just one screen column of it can be shown.
+ */
+char *
+pardiff_read_line(pardiff_reader_t *rd, size_t *len)
+{
+    const size_t max_len = PARDIFF_LINE_BUF_SIZE - 1;
+
+    reader_release(rd);
+
+    for (;;) {
+        const size_t avail = rd->end - rd->pos;
+        const size_t scan = avail <= max_len ? avail : max_len + 1;
+        char *const line = rd->buf + rd->pos;
+        const char *const nl = (const char *)memchr(line, '\n', scan);
+
+        size_t n = 0;
+        if (nl) {
+            n = (size_t)(nl - line) + 1;
+        } else if (avail > max_len) {
+            n = max_len;
+            rd->clipped = 1;
+        } else if (rd->eof && avail > 0) {
+            n = avail;
+        } else if (rd->eof) {
+            return NULL;
+        }
+
+        if (n > 0) {
+            rd->pos += n;
+            rd->offset += (long long)n;
+            rd->held = rd->buf[rd->pos];
+            rd->held_pos = rd->pos;
+            rd->buf[rd->pos] = '\0';
+            *len = n;
+            return line;
+        }
+
+        reader_fill(rd);
+    }
+}
+
+/*
+ * Where in the input the next line starts, or -1 if that is not known
+ * because the input is being transcoded.  The current line is done
+ * with.
+ */
+long long
+pardiff_reader_tell(pardiff_reader_t *rd)
+{
+    reader_release(rd);
+    return rd->raw ? -1 : rd->base + rd->offset;
+}
+
+/*
+ * Number of newlines in buf.  This is what runs over hunk bodies that
+ * are counted but never shown, so it takes 16 bytes at a time.
+ */
+static size_t
+count_newlines(const char *buf, size_t len)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+#ifdef PARDIFF_HAVE_SSE2
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            mask &= mask - 1;
+            ++n;
+        }
+    }
+#endif
+
+    const char *cp = buf + i;
+    const char *const end = buf + len;
+    while ((cp = (const char *)memchr(cp, '\n', (size_t)(end - cp))) != NULL) {
+        ++n;
+        ++cp;
+    }
+    return n;
+}
+
+/*
+ * Record base + i + 1 in starts[] for every newline at buf[i], that is,
+ * where each following line starts.  starts[] must have room for len
+ * entries.  Returns how many were recorded.
+ */
+size_t
+pardiff_line_starts(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+#ifdef PARDIFF_HAVE_SSE2
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+#else
+            const unsigned bit = (unsigned)__builtin_ctz(mask);
+#endif
+            starts[n++] = base + i + bit + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    const char *cp = buf + i;
+    const char *const end = buf + len;
+    while ((cp = (const char *)memchr(cp, '\n', (size_t)(end - cp))) != NULL) {
+        ++cp;
+        starts[n++] = base + (size_t)(cp - buf);
+    }
+    return n;
+}
+
+#define SKIP_BLOCK_MIN 256
+#define SKIP_BLOCK_MAX 65536
+
+/*
+ * Pass over the next count lines without returning them, however long
+ * they are.  Returns the number of lines skipped, less than count only
+ * at end of input.
+ */
+long long
+pardiff_skip_lines(pardiff_reader_t *rd, long long count)
+{
+    long long done = 0;
+    int partial = 0;    /* stopped inside a line */
+    size_t block_size = SKIP_BLOCK_MIN;
+
+    reader_release(rd);
+
+    while (done < count) {
+        char *const start = rd->buf + rd->pos;
+        const size_t avail = rd->end - rd->pos;
+
+        if (avail == 0) {
+            if (rd->eof) {
+                /* an unterminated last line still counts */
+                if (partial) ++done;
+                break;
+            }
+            reader_fill(rd);
+            continue;
+        }
+
+        /*
+         * Whole blocks go by on the newline count alone.  Blocks start
+         * small so that short hunks do not pay for counting far ahead.
+         */
+        const size_t block = avail < block_size ? avail : block_size;
+        const size_t nls = count_newlines(start, block);
+        if (block_size < SKIP_BLOCK_MAX) {
+            block_size *= 2;
+        }
+        if ((long long)nls < count - done) {
+            done += (long long)nls;
+            rd->pos += block;
+            rd->offset += (long long)block;
+            partial = start[block - 1] != '\n';
+            if (rd->pos == rd->end && !rd->eof) {
+                reader_fill(rd);
+            }
+            continue;
+        }
+
+        const char *cp = start;
+        for (; done < count; ++done) {
+            cp = (const char *)memchr(cp, '\n', block - (size_t)(cp - start)) + 1;
+        }
+        rd->pos += (size_t)(cp - start);
+        rd->offset += (long long)(cp - start);
+    }
+    return done;
+}
+
+/*
+ * Length of the leading run of str that needs no translation on output,
+ * that is, has no control character (below 0x20, or DEL).  Bytes from
+ * 0x80 up pass through untouched so UTF-8 is left alone.
+ */
+size_t
+pardiff_plain_run(const char *str, size_t len)
+{
+    size_t i = 0;
+
+#ifdef PARDIFF_HAVE_SSE2
+    const __m128i below = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        /* unsigned v <= 0x1f exactly when max(v, 0x1f) == 0x1f */
+        const __m128i ctl = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, below), below),
+                                         _mm_cmpeq_epi8(v, del));
+        const unsigned mask = (unsigned)_mm_movemask_epi8(ctl);
+        if (mask) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return i + bit;
+#else
+            return i + (size_t)__builtin_ctz(mask);
+#endif
+        }
+    }
+#else
+    /* eight bytes at a time: flags any byte below 0x20 or equal to 0x7f */
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, str + i, sizeof(w));
+        const uint64_t x = w ^ 0x7f7f7f7f7f7f7f7fULL;
+        const uint64_t ctl = ((w - 0x2020202020202020ULL) & ~w)
+                           | ((x - 0x0101010101010101ULL) & ~x);
+        if (ctl & 0x8080808080808080ULL) break;
+    }
+#endif
+
+    for (; i < len; ++i) {
+        const unsigned char c = (unsigned char)str[i];
+        if (c < 0x20 || c == 0x7f) break;
+    }
+    return i;
+}
+
+/*
+ * A line is taken for binary data once NUL bytes make up a noticeable
+ * share of it; text with a single stray NUL, however short the line, is
+ * still shown, escaped.
+ */
+int
+pardiff_is_binary(const char *str, size_t len)
+{
+    size_t nuls = 0;
+    const char *cp = str;
+    const char *const end = str + len;
+    while ((cp = (const char *)memchr(cp, '\0', (size_t)(end - cp))) != NULL) {
+        ++nuls;
+        ++cp;
+    }
+    return nuls >= PARDIFF_BINARY_MIN_NULS && nuls * PARDIFF_BINARY_NUL_RATIO >= len;
+}
+
+/*
+ * Look a line of hunk text through once, for a model that renders it
+ * many times over.  Returns PARDIFF_LINE_* flags for the text after its
+ * "< " or "> ".
+ */
+int
+pardiff_measure_line(const char *line, size_t len)
+{
+    const char *const body = line + (len > 2 ? 2 : len);
+    const size_t body_len = len > 2 ? len - 2 : 0;
+    const size_t text = (body_len > 0 && body[body_len - 1] == '\n') ? body_len - 1 : body_len;
+
+    if (pardiff_is_binary(body, body_len)) {
+        return PARDIFF_LINE_MEASURED | PARDIFF_LINE_BINARY;
+    }
+    if (pardiff_plain_run(body, text) == text) {
+        return PARDIFF_LINE_MEASURED | PARDIFF_LINE_PLAIN;
+    }
+    return PARDIFF_LINE_MEASURED;
+}
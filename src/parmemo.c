@@ -0,0 +1,258 @@
+/***************************************************************************
+ * parmemo.c                                                               *
+ *                                                                         *
+ * Memo of rendered hunks.  A mechanical change to many files repeats the  *
+ * same hunk over and over; each distinct hunk body is rendered once, and  *
+ * its copies are written from the saved bytes or, when asked for, shown   *
+ * as a one-line reference to the first one.                               *
+ *                                                                         *
+ * The renderers write hunk bodies through pardiff_out_write() and         *
+ * pardiff_out_fill() so that a body can be captured as it is rendered.    *
+ * A hunk is looked up by a hash of everything its body depends on, and   *
+ * only taken for a repeat if all of that is the same byte for byte.       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#define MEMO_HASH_PRIME 0x100000001b3ULL
+#define MEMO_INIT_SIZE 256
+
+typedef struct _memo_entry_t {
+    unsigned long long key;     /* 0 for an empty slot */
+    char   *material;           /* what the key is a hash of */
+    size_t  material_len;
+    char   *body;
+    size_t  len;
+    char   *label;              /* where the hunk was first seen */
+} memo_entry_t;
+
+static int memo_mode = PARDIFF_MEMO_AUTO;
+
+static memo_entry_t *memo_table = NULL;
+static size_t memo_arsz = 0;
+static size_t memo_count = 0;
+static size_t memo_bytes = 0;
+
+/* key of the hunk at hand, and what it is a hash of */
+static unsigned long long key_hash = PARDIFF_MEMO_HASH_INIT;
+static char *key_buf = NULL;
+static size_t key_len = 0;
+static size_t key_size = 0;
+static memo_entry_t *key_found = NULL;
+
+/* body being captured */
+static int capturing = 0;
+static char *cap_buf = NULL;
+static size_t cap_len = 0;
+static size_t cap_size = 0;
+
+void
+pardiff_memo_set(int mode)
+{
+    memo_mode = mode;
+}
+
+int
+pardiff_memo_mode(void)
+{
+    return memo_mode;
+}
+
+/*
+ * Forget all hunks, at the start of an input.
+ */
+void
+pardiff_memo_reset(void)
+{
+    for (size_t i = 0; i < memo_arsz; ++i) {
+        free(memo_table[i].material);
+        free(memo_table[i].body);
+        free(memo_table[i].label);
+    }
+    free(memo_table);
+    memo_table = NULL;
+    memo_arsz = memo_count = memo_bytes = 0;
+    key_found = NULL;
+}
+
+unsigned long long
+pardiff_memo_hash(unsigned long long h, const void *data, size_t len)
+{
+    const unsigned char *const cp = (const unsigned char *)data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ cp[i]) * MEMO_HASH_PRIME;
+    }
+    return h;
+}
+
+/*
+ * Start the key of a hunk.
+ */
+void
+pardiff_memo_key_begin(void)
+{
+    key_hash = PARDIFF_MEMO_HASH_INIT;
+    key_len = 0;
+    key_found = NULL;
+}
+
+/*
+ * Add to the key something the rendered body depends on.
+ */
+void
+pardiff_memo_key_add(const void *data, size_t len)
+{
+    key_hash = pardiff_memo_hash(key_hash, data, len);
+    if (key_len + len > key_size) {
+        key_size = (key_len + len) * 2;
+        char *key_buf_new = (char *)realloc(key_buf, key_size);
+        if (!key_buf_new) abort();
+        key_buf = key_buf_new;
+    }
+    memcpy(key_buf + key_len, data, len);
+    key_len += len;
+}
+
+static unsigned long long
+key_value(void)
+{
+    return key_hash != 0 ? key_hash : 1;
+}
+
+/*
+ * The entry for the key at hand, or the empty slot it would go in.  A
+ * hash that matches with different material is passed over like any
+ * other entry in the way.
+ */
+static memo_entry_t *
+memo_slot(unsigned long long key)
+{
+    size_t i = (size_t)(key ^ (key >> 32)) & (memo_arsz - 1);
+    for (;; i = (i + 1) & (memo_arsz - 1)) {
+        const memo_entry_t *const m = &memo_table[i];
+        if (m->key == 0) break;
+        if (m->key == key && m->material_len == key_len
+            && memcmp(m->material, key_buf, key_len) == 0) {
+            break;
+        }
+    }
+    return &memo_table[i];
+}
+
+/*
+ * Look up the hunk whose key is at hand.  Returns where it was first
+ * seen, or NULL if it is new.
+ */
+const char *
+pardiff_memo_find(void)
+{
+    if (memo_arsz == 0) return NULL;
+
+    memo_entry_t *const m = memo_slot(key_value());
+    key_found = m->key != 0 ? m : NULL;
+    return key_found ? key_found->label : NULL;
+}
+
+/*
+ * Write out the body of the hunk pardiff_memo_find() just found.
+ */
+void
+pardiff_memo_write(void)
+{
+    if (key_found) {
+        fwrite(key_found->body, 1, key_found->len, stdout);
+    }
+}
+
+/*
+ * Start capturing the body of a new hunk.
+ */
+void
+pardiff_memo_capture(void)
+{
+    capturing = 1;
+    cap_len = 0;
+}
+
+/*
+ * Write out the captured body and remember it under the key at hand,
+ * as long as the memo has room for it.
+ */
+void
+pardiff_memo_store(const char *label)
+{
+    capturing = 0;
+    fwrite(cap_buf, 1, cap_len, stdout);
+
+    if (memo_bytes + key_len + cap_len > PARDIFF_MEMO_BYTES) return;
+
+    if (memo_count * 2 >= memo_arsz) {
+        memo_entry_t *const old_table = memo_table;
+        const size_t old_arsz = memo_arsz;
+        memo_arsz = memo_arsz ? memo_arsz * 2 : MEMO_INIT_SIZE;
+        memo_table = (memo_entry_t *)calloc(memo_arsz, sizeof(memo_entry_t));
+        if (!memo_table) abort();
+        for (size_t i = 0; i < old_arsz; ++i) {
+            /* no two entries are the same, so each goes in a free slot */
+            const unsigned long long key = old_table[i].key;
+            if (key == 0) continue;
+            size_t j = (size_t)(key ^ (key >> 32)) & (memo_arsz - 1);
+            while (memo_table[j].key != 0) {
+                j = (j + 1) & (memo_arsz - 1);
+            }
+            memo_table[j] = old_table[i];
+        }
+        free(old_table);
+    }
+
+    memo_entry_t *const m = memo_slot(key_value());
+    if (m->key != 0) return;
+    const size_t label_len = strlen(label);
+    m->material = (char *)malloc(key_len ? key_len : 1);
+    m->body = (char *)malloc(cap_len ? cap_len : 1);
+    m->label = (char *)malloc(label_len + 1);
+    if (!m->material || !m->body || !m->label) abort();
+    memcpy(m->material, key_buf, key_len);
+    memcpy(m->body, cap_buf, cap_len);
+    memcpy(m->label, label, label_len + 1);
+    m->material_len = key_len;
+    m->len = cap_len;
+    m->key = key_value();
+    ++memo_count;
+    memo_bytes += key_len + cap_len;
+}
+
+void
+pardiff_out_write(const char *str, size_t len)
+{
+    if (!capturing) {
+        fwrite(str, 1, len, stdout);
+        return;
+    }
+    if (cap_len + len > cap_size) {
+        cap_size = (cap_len + len) * 2;
+        char *cap_buf_new = (char *)realloc(cap_buf, cap_size);
+        if (!cap_buf_new) abort();
+        cap_buf = cap_buf_new;
+    }
+    memcpy(cap_buf + cap_len, str, len);
+    cap_len += len;
+}
+
+void
+pardiff_out_fill(char c, int n)
+{
+    char fill[64];
+    memset(fill, c, sizeof(fill));
+    for (; n > 0; n -= (int)sizeof(fill)) {
+        pardiff_out_write(fill, n < (int)sizeof(fill) ? (size_t)n : sizeof(fill));
+    }
+}
@@ -0,0 +1,293 @@
+/***************************************************************************
+ * parmodel.c                                                              *
+ *                                                                         *
+ * Parsed diff model.  A normal diff is parsed once into its file lines    *
+ * and hunks, with the hunk text kept raw, so that it can be rendered at   *
+ * any width, several times over, or saved to a file and rendered later    *
+ * without going back to the diff.                                         *
+ *                                                                         *
+ * The model is one buffer of records, each a fixed head followed by the   *
+ * line ends, the line flags and the text of the hunk.  Each line is       *
+ * measured as it goes in, so that a render does not look it through for   *
+ * binary data or control characters again.  A saved model is that buffer  *
+ * as it is, so it is only read back on the same kind of machine.          *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+/* records start on this boundary */
+#define MODEL_ALIGN 8
+
+typedef struct _model_file_head_t {
+    char         magic[8];
+    unsigned int byte_order;
+    unsigned int size_t_size;
+} model_file_head_t;
+
+typedef struct _model_head_t {
+    long long x1;
+    long long x2;
+    long long y1;
+    long long y2;
+    size_t    lines;
+    size_t    len;
+    size_t    tail;
+    int       cmd;              /* 0 for a "diff" line or the tail */
+    int       kind;
+} model_head_t;
+
+static const char model_magic[8] = { 'P', 'D', 'M', 'O', 'D', 'E', 'L', '2' };
+
+static size_t
+model_align(size_t n)
+{
+    return (n + MODEL_ALIGN - 1) & ~(size_t)(MODEL_ALIGN - 1);
+}
+
+static void
+model_file_head(model_file_head_t *fh)
+{
+    memset(fh, 0, sizeof(*fh));
+    memcpy(fh->magic, model_magic, sizeof(fh->magic));
+    fh->byte_order = 0x01020304;
+    fh->size_t_size = (unsigned int)sizeof(size_t);
+}
+
+void
+pardiff_model_init(pardiff_model_t *m)
+{
+    m->size = 64 * 1024;
+    m->buf = (char *)malloc(m->size);
+    if (!m->buf) abort();
+    model_file_head((model_file_head_t *)m->buf);
+    m->len = model_align(sizeof(model_file_head_t));
+    m->tail = 0;
+}
+
+void
+pardiff_model_free(pardiff_model_t *m)
+{
+    free(m->buf);
+    m->buf = NULL;
+    m->len = m->size = 0;
+}
+
+static char *
+model_reserve(pardiff_model_t *m, size_t n)
+{
+    if (m->len + n > m->size) {
+        m->size = (m->len + n) * 2;
+        char *buf_new = (char *)realloc(m->buf, m->size);
+        if (!buf_new) abort();
+        m->buf = buf_new;
+    }
+    char *const rec = m->buf + m->len;
+    m->len += n;
+    return rec;
+}
+
+/*
+ * Add a hunk, or with cmd 0 a "diff" line of a recursive diff in text.
+ * Lines not measured yet are measured here.
+ */
+void
+pardiff_model_add(pardiff_model_t *m, const pardiff_hunk_t *h)
+{
+    const size_t ends_size = sizeof(size_t) * h->lines;
+    const size_t size = model_align(sizeof(model_head_t) + ends_size + h->lines + h->len);
+    if (h->kind & PARDIFF_HUNK_TAIL) m->tail = m->len;
+    char *const rec = model_reserve(m, size);
+
+    model_head_t head;
+    memset(&head, 0, sizeof(head));
+    head.x1 = h->x1;
+    head.x2 = h->x2;
+    head.y1 = h->y1;
+    head.y2 = h->y2;
+    head.lines = h->lines;
+    head.len = h->len;
+    head.tail = h->tail;
+    head.cmd = h->cmd;
+    head.kind = h->kind;
+
+    char *cp = rec;
+    memcpy(cp, &head, sizeof(head));
+    cp += sizeof(head);
+    if (h->lines > 0) {
+        memcpy(cp, h->ends, ends_size);
+        cp += ends_size;
+        for (size_t i = 0, start = 0; i < h->lines; start = h->ends[i++]) {
+            int flags = h->flags[i];
+            if (!(flags & PARDIFF_LINE_MEASURED)) {
+                flags |= pardiff_measure_line(h->text + start, h->ends[i] - start);
+            }
+            *cp++ = (char)flags;
+        }
+    }
+    memcpy(cp, h->text, h->len);
+    cp += h->len;
+    memset(cp, 0, (size_t)(rec + size - cp));
+}
+
+/*
+ * Step to the record at *pos.  Returns 1 with the record in *h, 0 at
+ * the end and -1 if the record does not fit in the model.
+ */
+int
+pardiff_model_next(const pardiff_model_t *m, size_t *pos, pardiff_hunk_t *h)
+{
+    if (*pos == m->len) return 0;
+    if (m->len - *pos < sizeof(model_head_t)) return -1;
+
+    const model_head_t *const head = (const model_head_t *)(m->buf + *pos);
+    const size_t room = m->len - *pos - sizeof(model_head_t);
+    if (head->lines > room / (sizeof(size_t) + 1)) return -1;
+    const size_t ends_size = sizeof(size_t) * head->lines;
+    if (head->len > room - ends_size - head->lines) return -1;
+
+    const char *cp = (const char *)(head + 1);
+    h->cmd = (char)head->cmd;
+    h->x1 = head->x1;
+    h->x2 = head->x2;
+    h->y1 = head->y1;
+    h->y2 = head->y2;
+    h->lines = head->lines;
+    h->len = head->len;
+    h->kind = head->kind;
+    h->tail = head->tail;
+    h->ends = (const size_t *)cp;
+    cp += ends_size;
+    h->flags = cp;
+    cp += head->lines;
+    h->text = cp;
+    cp += head->len;
+
+    *pos = model_align((size_t)(cp - m->buf));
+    if (*pos > m->len) *pos = m->len;
+    return 1;
+}
+
+/*
+ * First record of a model.
+ */
+size_t
+pardiff_model_start(void)
+{
+    return model_align(sizeof(model_file_head_t));
+}
+
+/*
+ * The tail of the input that an open hunk reads on into.  Returns 1
+ * with it in *h, or 0 if the model has none.
+ */
+int
+pardiff_model_tail(const pardiff_model_t *m, pardiff_hunk_t *h)
+{
+    size_t pos = m->tail;
+    return pos != 0 && pardiff_model_next(m, &pos, h) > 0;
+}
+
+int
+pardiff_model_save(const pardiff_model_t *m, const char *path)
+{
+    FILE *fp = NULL;
+#ifdef _MSC_VER
+    if (fopen_s(&fp, path, "wb") != 0) fp = NULL;
+#else
+    fp = fopen(path, "wb");
+#endif
+    if (!fp) {
+        perror(path);
+        return 1;
+    }
+    const size_t put = fwrite(m->buf, 1, m->len, fp);
+    if (fclose(fp) != 0 || put != m->len) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read a saved model from fp and check it through.  Returns 0, or 1 if
+ * fp does not hold a model this build can use.
+ */
+int
+pardiff_model_load(pardiff_model_t *m, FILE *fp)
+{
+    model_file_head_t want;
+    model_file_head(&want);
+
+    m->len = 0;
+    for (;;) {
+        if (m->len == m->size) {
+            m->size *= 2;
+            char *buf_new = (char *)realloc(m->buf, m->size);
+            if (!buf_new) abort();
+            m->buf = buf_new;
+        }
+        const size_t got = fread(m->buf + m->len, 1, m->size - m->len, fp);
+        if (got == 0) break;
+        m->len += got;
+    }
+    if (m->len < pardiff_model_start() || memcmp(m->buf, &want, sizeof(want)) != 0) {
+        return 1;
+    }
+
+    pardiff_hunk_t h;
+    size_t pos = pardiff_model_start();
+    size_t open_tail = 0;   /* tail lines the open hunks read from */
+    int opens = 0;
+    int rc = 0;
+    m->tail = 0;
+    for (;;) {
+        const size_t at = pos;
+        if ((rc = pardiff_model_next(m, &pos, &h)) <= 0) break;
+
+        const long long x_lines = h.x2 - h.x1 + 1;
+        const long long y_lines = h.y2 - h.y1 + 1;
+        long long want_lines = 0;
+        switch (h.cmd) {
+            case 'a': want_lines = y_lines; break;
+            case 'd': want_lines = x_lines; break;
+            case 'c': want_lines = x_lines + 1 + y_lines; break;
+            default:  break;    /* a command the renderer shows bare */
+        }
+        if (want_lines < 0) want_lines = 0;
+
+        if (h.cmd == 0 && h.kind == PARDIFF_HUNK_TAIL) {
+            if (m->tail != 0) return 1;
+            m->tail = at;
+        } else if (h.cmd == 0) {
+            if (h.kind != PARDIFF_HUNK_WHOLE || h.lines != 0) return 1;
+        } else {
+            if (h.kind & ~(PARDIFF_HUNK_CUT | PARDIFF_HUNK_OPEN)) return 1;
+            if ((h.kind & PARDIFF_HUNK_CUT) ? h.lines >= (size_t)want_lines
+                                            : h.lines != (size_t)want_lines) return 1;
+            if (h.kind & PARDIFF_HUNK_OPEN) {
+                ++opens;
+                if (h.tail > open_tail) open_tail = h.tail;
+            }
+        }
+
+        for (size_t i = 0, start = 0; i < h.lines; start = h.ends[i++]) {
+            if (h.ends[i] > h.len || h.ends[i] < start) return 1;
+            /* a line taken as plain is put out as it is, so it must be */
+            const int flags = h.flags[i] & ~PARDIFF_LINE_CLIPPED;
+            if (flags != pardiff_measure_line(h.text + start, h.ends[i] - start)) return 1;
+        }
+    }
+    if (rc < 0) return 1;
+    if (opens > 0) {
+        if (!pardiff_model_tail(m, &h) || open_tail > h.lines) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/***************************************************************************
+ * paroutput.c                                                             *
+ *                                                                         *
+ * Output to a file, rendered in parts at once.  Every row of a normal    *
+ * diff rendering is the same number of bytes, so where each hunk goes    *
+ * in the output is known from the hunk lines alone.  Each part is         *
+ * rendered by its own process, straight to its place in the file; no     *
+ * part waits for the one before it.                                       *
+ *                                                                         *
+ * Usage: pardiff -o FILE [--workers N] ...                                *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+#include <sys/wait.h>
+
+/*
+ * Point stdout at path.  With keep, what is in the file is kept, for a
+ * render to resume.
+ */
+int
+pardiff_output_open(const char *path, int keep)
+{
+    const int fd = open(path, O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Render parts parts of one input at once into the output file at path,
+ * which stdout is pointed at.  Part i is written by render(prog, i) to
+ * a stdout of its own, opened on the file at offsets[i] past where the
+ * output is now.  The file is first sized to size more bytes, unless
+ * size is negative.  stdout is left at the end of the file.
+ */
+int
+pardiff_output_parts(const char *prog, const char *path, int parts,
+                     const long long *offsets, long long size,
+                     int (*render)(const char *prog, int part))
+{
+    if (fflush(stdout) != 0) {
+        perror(path);
+        return 1;
+    }
+    const off_t base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (base < 0 || (size >= 0 && ftruncate(STDOUT_FILENO, base + (off_t)size) != 0)) {
+        perror(path);
+        return 1;
+    }
+
+    pid_t *const pids = (pid_t *)malloc(sizeof(pid_t) * (size_t)parts);
+    if (!pids) abort();
+
+    int rc = 0;
+    int started = 0;
+    for (; started < parts; ++started) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            rc = 1;
+            break;
+        }
+        if (pid == 0) {
+            const int fd = open(path, O_WRONLY);
+            if (fd < 0 || lseek(fd, base + (off_t)offsets[started], SEEK_SET) < 0
+                || dup2(fd, STDOUT_FILENO) < 0) {
+                perror(path);
+                _exit(1);
+            }
+            close(fd);
+            const int part_rc = render(prog, started);
+            _exit(fflush(stdout) != 0 ? 1 : part_rc);
+        }
+        pids[started] = pid;
+    }
+
+    for (int i = 0; i < started; ++i) {
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            rc = 1;
+        }
+    }
+    free(pids);
+
+    if (fseeko(stdout, 0, SEEK_END) != 0) {
+        perror(path);
+        rc = 1;
+    }
+    return rc;
+}
+
+#endif
@@ -0,0 +1,157 @@
+/***************************************************************************
+ * parresume.c                                                             *
+ *                                                                         *
+ * Checkpoints of a long render.  Between hunks the parser can stop and    *
+ * start again from a small record of where it was in the input and the    *
+ * output, so a render that was cut off carries on from there instead of   *
+ * from the start.                                                         *
+ *                                                                         *
+ * Usage: pardiff --checkpoint FILE [--resume] ... >> OUTPUT               *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+
+static const char checkpoint_magic[] = "pardiff checkpoint 2\n";
+
+/* text of any bytes, as its length on a line of its own and then itself */
+static void
+put_text(FILE *fp, const char *tag, const char *text, size_t len)
+{
+    fprintf(fp, "%s %zu\n", tag, len);
+    fwrite(text, 1, len, fp);
+    putc('\n', fp);
+}
+
+static int
+get_text(FILE *fp, const char *tag, char *text, size_t size, size_t *len)
+{
+    char line[64];
+    char want[32];
+    size_t n = 0;
+
+    snprintf(want, sizeof(want), "%s %%zu", tag);
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, want, &n) != 1 || n >= size) {
+        return 1;
+    }
+    if (fread(text, 1, n, fp) != n || getc(fp) != '\n') return 1;
+    text[n] = '\0';
+    *len = n;
+    return 0;
+}
+
+static int
+get_number(FILE *fp, const char *tag, long long *n)
+{
+    char line[64];
+    char want[32];
+
+    snprintf(want, sizeof(want), "%s %%lld", tag);
+    return !fgets(line, sizeof(line), fp) || sscanf(line, want, n) != 1;
+}
+
+/*
+ * Write a checkpoint.  It is written beside path and renamed over it,
+ * so that a run cut off while writing leaves the one before in place.
+ */
+int
+pardiff_checkpoint_save(const char *path, const pardiff_checkpoint_t *cp)
+{
+    char tmp[PARDIFF_LINE_BUF_SIZE];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *const fp = fopen(tmp, "w");
+    if (!fp) {
+        perror(tmp);
+        return 1;
+    }
+    fputs(checkpoint_magic, fp);
+    put_text(fp, "key", cp->key, strlen(cp->key));
+    fprintf(fp, "operand %d\n", cp->operand);
+    put_text(fp, "name", cp->in_name, strlen(cp->in_name));
+    fprintf(fp, "size %lld\n", cp->in_size);
+    fprintf(fp, "mtime %lld\n", cp->in_mtime);
+    fprintf(fp, "device %lld\n", cp->in_dev);
+    fprintf(fp, "inode %lld\n", cp->in_ino);
+    fprintf(fp, "input %lld\n", cp->in_offset);
+    fprintf(fp, "output %lld\n", cp->out_offset);
+    fprintf(fp, "state %d\n", cp->state);
+    fprintf(fp, "numwid %d\n", cp->num_wid);
+    fprintf(fp, "gotinput %d\n", cp->got_input);
+    fprintf(fp, "memo %d\n", cp->memo);
+    fprintf(fp, "seen %lld\n", cp->ctx_seen);
+    fprintf(fp, "after %lld\n", cp->ctx_after[0]);
+    fprintf(fp, "after %lld\n", cp->ctx_after[1]);
+    fprintf(fp, "aftern %lld\n", cp->ctx_after_n);
+    put_text(fp, "file", cp->file_line, cp->file_len);
+
+    const int failed = fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0 || failed || rename(tmp, path) != 0) {
+        perror(tmp);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read the checkpoint at path.  Returns 0, 1 if there is none, which
+ * is a render to start from the beginning, or -1 if it is not usable.
+ */
+int
+pardiff_checkpoint_load(const char *path, pardiff_checkpoint_t *cp)
+{
+    FILE *const fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return 1;
+        perror(path);
+        return -1;
+    }
+
+    char magic[sizeof(checkpoint_magic)];
+    size_t key_len = 0;
+    size_t name_len = 0;
+    long long n[5];
+    int bad = !fgets(magic, sizeof(magic), fp) || strcmp(magic, checkpoint_magic) != 0
+           || get_text(fp, "key", cp->key, sizeof(cp->key), &key_len)
+           || get_number(fp, "operand", &n[0])
+           || get_text(fp, "name", cp->in_name, sizeof(cp->in_name), &name_len)
+           || get_number(fp, "size", &cp->in_size)
+           || get_number(fp, "mtime", &cp->in_mtime)
+           || get_number(fp, "device", &cp->in_dev)
+           || get_number(fp, "inode", &cp->in_ino)
+           || get_number(fp, "input", &cp->in_offset)
+           || get_number(fp, "output", &cp->out_offset)
+           || get_number(fp, "state", &n[1])
+           || get_number(fp, "numwid", &n[2])
+           || get_number(fp, "gotinput", &n[3])
+           || get_number(fp, "memo", &n[4])
+           || get_number(fp, "seen", &cp->ctx_seen)
+           || get_number(fp, "after", &cp->ctx_after[0])
+           || get_number(fp, "after", &cp->ctx_after[1])
+           || get_number(fp, "aftern", &cp->ctx_after_n)
+           || get_text(fp, "file", cp->file_line, sizeof(cp->file_line), &cp->file_len);
+    fclose(fp);
+
+    if (!bad) {
+        cp->operand = (int)n[0];
+        cp->state = (int)n[1];
+        cp->num_wid = (int)n[2];
+        cp->got_input = (int)n[3];
+        cp->memo = (int)n[4];
+        bad = n[0] < 0 || cp->in_offset < 0 || cp->in_offset > cp->in_size || cp->out_offset < 0
+           || n[2] < PARDIFF_MIN_NUM_WID || n[2] > 32;
+    }
+    return bad ? -1 : 0;
+}
+
+#endif
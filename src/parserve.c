@@ -0,0 +1,472 @@
+/***************************************************************************
+ * parserve.c                                                              *
+ *                                                                         *
+ * Persistent server mode.  A pool of pre-forked worker processes accepts  *
+ * rendering requests on a Unix domain socket, so a busy caller does not   *
+ * pay for process startup and terminal probing on every small diff.       *
+ *                                                                         *
+ * Usage: pardiff --serve SOCKET                                           *
+ *        diff f1 f2 | pardiff --connect SOCKET                            *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * Request protocol: the client sends its options one per line, then an
+ * empty line, then the diff text, and shuts down its sending side.  The
+ * server streams the rendered output back, then what the request wrote
+ * to stderr, at most SERVE_MAX_ERR bytes of it, then a trailer of
+ * SERVE_TRAILER_SIZE bytes giving the exit status and the length of that
+ * text, and closes the connection.
+ */
+#define SERVE_MAX_ARGS 64
+#define SERVE_MAX_WORKERS 256
+#define SERVE_IO_BUF_SIZE 65536
+#define SERVE_MAX_ERR 16384
+#define SERVE_TRAILER "pardiff status %03d %05d\n"
+#define SERVE_TRAILER_SCAN "pardiff status %3d %5d"
+#define SERVE_TRAILER_SIZE 25
+
+/* what the client holds back until it knows where the output ends */
+#define SERVE_TAIL_SIZE (SERVE_MAX_ERR + SERVE_TRAILER_SIZE)
+
+static volatile sig_atomic_t serve_stop = 0;
+
+/* output buffer kept by each worker for all of its requests */
+static char serve_outbuf[SERVE_IO_BUF_SIZE];
+
+static void
+serve_on_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/*
+ * Send what the request wrote to stderr, kept in err_fd, and its status
+ * after its output.
+ */
+static void
+serve_reply_status(int err_fd, int rc)
+{
+    static char err[SERVE_MAX_ERR];
+    ssize_t len = 0;
+
+    fflush(stderr);
+    const off_t size = lseek(err_fd, 0, SEEK_CUR);
+    if (size > 0) {
+        len = pread(err_fd, err, size < SERVE_MAX_ERR ? (size_t)size : SERVE_MAX_ERR, 0);
+        if (len < 0) len = 0;
+    }
+    fwrite(err, 1, (size_t)len, stdout);
+    printf(SERVE_TRAILER, rc & 0xff, (int)len);
+}
+
+static void
+serve_request(const char *prog, int conn, int stdout_fd, int err_fd)
+{
+    char line[PARDIFF_LINE_BUF_SIZE];
+    char *args[SERVE_MAX_ARGS + 1];
+    int nargs = 0;
+    int ok = 0;
+    int rc = 1;
+
+    FILE *fp = fdopen(conn, "r");
+    if (!fp) {
+        close(conn);
+        return;
+    }
+    /* the input follows the arguments, and is read from conn directly */
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    args[nargs++] = (char *)prog;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n' || nargs == SERVE_MAX_ARGS) break;
+        line[--len] = '\0';
+        if (len == 0) {
+            ok = 1;
+            break;
+        }
+        args[nargs] = strdup(line);
+        if (!args[nargs]) abort();
+        ++nargs;
+    }
+    args[nargs] = NULL;
+
+    /*
+     * The renderers write to stdout, so point it at the client, and keep
+     * what they write to stderr to send after it.
+     */
+    fflush(stdout);
+    fflush(stderr);
+    dup2(conn, STDOUT_FILENO);
+    const int stderr_fd = dup(STDERR_FILENO);
+    if (ftruncate(err_fd, 0) == 0 && lseek(err_fd, 0, SEEK_SET) == 0) {
+        dup2(err_fd, STDERR_FILENO);
+    }
+    if (ok) {
+        rc = pardiff_request(prog, nargs, args, fp);
+    } else {
+        fprintf(stderr, "%s: bad request\n", prog);
+    }
+    serve_reply_status(err_fd, rc);
+    PARDIFF_PROBE(flush);
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    clearerr(stdout);
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stderr_fd);
+
+    /*
+     * A request turned down early leaves input unread, and closing on it
+     * would reset the connection and lose the reply: end the reply, then
+     * take the rest of the input.
+     */
+    shutdown(conn, SHUT_WR);
+    for (;;) {
+        const ssize_t n = read(conn, line, sizeof(line));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+
+    fclose(fp);
+    for (int i = 1; i < nargs; ++i) {
+        free(args[i]);
+    }
+}
+
+static void
+serve_worker(const char *prog, int sock)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    setvbuf(stdout, serve_outbuf, _IOFBF, sizeof(serve_outbuf));
+    const int stdout_fd = dup(STDOUT_FILENO);
+
+    /* what each request writes to stderr is kept here for the client */
+    FILE *const err_fp = tmpfile();
+    if (!err_fp) {
+        perror("tmpfile");
+        _exit(1);
+    }
+    const int err_fd = fileno(err_fp);
+
+    for (;;) {
+        const int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            _exit(1);
+        }
+        serve_request(prog, conn, stdout_fd, err_fd);
+    }
+}
+
+static pid_t
+serve_spawn(const char *prog, int sock)
+{
+    fflush(stdout);
+    fflush(stderr);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        serve_worker(prog, sock);
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+int
+pardiff_serve_main(const char *prog, const char *path, int workers)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long: %s\n", prog, path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* only ever remove a stale socket, never some other file */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    /*
+     * Only the owner may connect: requests are run by the workers as the
+     * server's user.  chmod the socket to let more in.
+     */
+    const mode_t old_mask = umask(077);
+    const int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound != 0) {
+        perror("bind");
+        close(sock);
+        return 1;
+    }
+    if (listen(sock, SOMAXCONN) != 0) {
+        perror("listen");
+        close(sock);
+        unlink(path);
+        return 1;
+    }
+
+    if (workers <= 0) {
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (workers > SERVE_MAX_WORKERS) {
+        workers = SERVE_MAX_WORKERS;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pid_t pids[SERVE_MAX_WORKERS];
+    for (int i = 0; i < workers; ++i) {
+        pids[i] = serve_spawn(prog, sock);
+    }
+
+    /* keep the pool full until told to stop */
+    while (!serve_stop) {
+        const pid_t pid = wait(NULL);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < workers; ++i) {
+            if (pids[i] == pid) {
+                pids[i] = serve_spawn(prog, sock);
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; ++i) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+
+    close(sock);
+    unlink(path);
+    return 0;
+}
+
+/* the end of the reply so far, which may be the error text and trailer */
+static char client_tail[SERVE_TAIL_SIZE];
+static size_t client_tail_len = 0;
+
+/*
+ * Take n more bytes of the reply, copying to stdout whatever can no
+ * longer be part of what follows the output.
+ */
+static int
+client_put(const char *data, size_t n)
+{
+    if (client_tail_len + n > SERVE_TAIL_SIZE) {
+        size_t out = client_tail_len + n - SERVE_TAIL_SIZE;
+        const size_t from_tail = out < client_tail_len ? out : client_tail_len;
+        if (fwrite(client_tail, 1, from_tail, stdout) != from_tail) return 1;
+        memmove(client_tail, client_tail + from_tail, client_tail_len - from_tail);
+        client_tail_len -= from_tail;
+        out -= from_tail;
+        if (fwrite(data, 1, out, stdout) != out) return 1;
+        data += out;
+        n -= out;
+    }
+    memcpy(client_tail + client_tail_len, data, n);
+    client_tail_len += n;
+    return 0;
+}
+
+/*
+ * At the end of the reply, split what was held back into the last of
+ * the output, the error text and the trailer.  Returns the server's
+ * status, or 1 if the reply was cut short.
+ */
+static int
+client_finish(const char *prog)
+{
+    int status = -1;
+    int err_len = -1;
+    char trailer[SERVE_TRAILER_SIZE + 1];
+
+    if (client_tail_len >= SERVE_TRAILER_SIZE) {
+        memcpy(trailer, client_tail + client_tail_len - SERVE_TRAILER_SIZE, SERVE_TRAILER_SIZE);
+        trailer[SERVE_TRAILER_SIZE] = '\0';
+        if (sscanf(trailer, SERVE_TRAILER_SCAN, &status, &err_len) != 2
+            || (size_t)err_len > client_tail_len - SERVE_TRAILER_SIZE) {
+            status = -1;
+        }
+    }
+    if (status < 0) {
+        fwrite(client_tail, 1, client_tail_len, stdout);
+        fprintf(stderr, "%s: reply cut short\n", prog);
+        return 1;
+    }
+
+    const size_t out = client_tail_len - SERVE_TRAILER_SIZE - (size_t)err_len;
+    if (fwrite(client_tail, 1, out, stdout) != out) return 1;
+    fflush(stdout);
+    fwrite(client_tail + out, 1, (size_t)err_len, stderr);
+    return status;
+}
+
+int
+pardiff_client_main(const char *prog, const char *path,
+                    int nargs, char *args[], int in_fd)
+{
+    struct sockaddr_un addr;
+    static char inbuf[SERVE_IO_BUF_SIZE];
+    static char outbuf[SERVE_IO_BUF_SIZE];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long: %s\n", prog, path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        close(sock);
+        return 1;
+    }
+
+    /* the header is small enough to go out in one piece */
+    size_t pend = 0;
+    for (int i = 0; i < nargs; ++i) {
+        const size_t len = strlen(args[i]);
+        if (pend + len + 2 > sizeof(inbuf)) {
+            fprintf(stderr, "%s: too many options\n", prog);
+            close(sock);
+            return 1;
+        }
+        memcpy(inbuf + pend, args[i], len);
+        pend += len;
+        inbuf[pend++] = '\n';
+    }
+    inbuf[pend++] = '\n';
+
+    /*
+     * Keep reading the reply while sending, or a server that is blocked
+     * writing to us would never get around to reading more input.
+     */
+    size_t off = 0;
+    int in_eof = 0;
+    int done = 0;
+    int rc = 0;
+    for (;;) {
+        if (!in_eof && off == pend) {
+            const ssize_t n = read(in_fd, inbuf, sizeof(inbuf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("read");
+                    rc = 1;
+                }
+                in_eof = 1;
+                shutdown(sock, SHUT_WR);
+            } else {
+                pend = (size_t)n;
+                off = 0;
+            }
+        }
+
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN | (off < pend ? POLLOUT : 0);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            rc = 1;
+            break;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            const ssize_t n = read(sock, outbuf, sizeof(outbuf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("read");
+                    rc = 1;
+                }
+                done = n == 0;
+                break;
+            }
+            if (client_put(outbuf, (size_t)n) != 0) {
+                rc = 1;
+                break;
+            }
+        }
+        if ((pfd.revents & POLLOUT) && off < pend) {
+            const ssize_t n = write(sock, inbuf + off, pend - off);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                if (errno == EPIPE) {
+                    /* the server has stopped reading; its reply is still to come */
+                    in_eof = 1;
+                    off = pend;
+                    continue;
+                }
+                perror("write");
+                rc = 1;
+                break;
+            }
+            off += (size_t)n;
+        }
+    }
+
+    close(sock);
+    if (done) {
+        const int status = client_finish(prog);
+        if (rc == 0) rc = status;
+    }
+    return rc;
+}
+
+#endif /* !PARDIFF_IS_DOS */
@@ -0,0 +1,162 @@
+/***************************************************************************
+ * parsource.c                                                             *
+ *                                                                         *
+ * The two files a normal diff was made from, for lines of context around  *
+ * its hunks.  The files are mapped, not read, and lines are indexed only  *
+ * as far as a hunk has asked for, so a small diff of a large file costs   *
+ * little more than the lines shown.                                       *
+ *                                                                         *
+ * Usage: pardiff --context-from FILE1 FILE2 [--context-lines N] ...      *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* bytes indexed at a time */
+#define SOURCE_INDEX_CHUNK (64 * 1024)
+
+typedef struct _source_t {
+    const char *data;
+    size_t      size;
+    size_t     *starts;         /* starts[i] is where line i + 1 starts */
+    size_t      nstarts;
+    size_t      arsz;
+    size_t      scanned;        /* bytes indexed so far */
+} source_t;
+
+static source_t sources[2];
+static int source_on = 0;
+static int context_lines = PARDIFF_DFLT_CONTEXT_LINES;
+
+static int
+source_map(source_t *src, const char *name)
+{
+    memset(src, 0, sizeof(*src));
+
+#ifndef PARDIFF_IS_DOS
+    const int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(name);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    src->size = (size_t)st.st_size;
+    if (src->size > 0) {
+        void *const data = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(name);
+            close(fd);
+            return 1;
+        }
+        src->data = (const char *)data;
+    }
+    close(fd);
+#else
+    FILE *fp = NULL;
+#ifdef _MSC_VER
+    if (fopen_s(&fp, name, "rb") != 0) fp = NULL;
+#else
+    fp = fopen(name, "rb");
+#endif
+    if (!fp) {
+        perror(name);
+        return 1;
+    }
+    size_t arsz = SOURCE_INDEX_CHUNK;
+    char *data = (char *)malloc(arsz);
+    if (!data) abort();
+    for (;;) {
+        if (src->size == arsz) {
+            arsz *= 2;
+            char *data_new = (char *)realloc(data, arsz);
+            if (!data_new) abort();
+            data = data_new;
+        }
+        const size_t got = fread(data + src->size, 1, arsz - src->size, fp);
+        if (got == 0) break;
+        src->size += got;
+    }
+    fclose(fp);
+    src->data = data;
+#endif
+
+    src->arsz = 1024;
+    src->starts = (size_t *)malloc(sizeof(size_t) * src->arsz);
+    if (!src->starts) abort();
+    src->starts[src->nstarts++] = 0;
+    return 0;
+}
+
+int
+pardiff_source_open(const char *name1, const char *name2)
+{
+    if (source_map(&sources[0], name1) != 0 || source_map(&sources[1], name2) != 0) {
+        return 1;
+    }
+    source_on = 1;
+    return 0;
+}
+
+int
+pardiff_source_active(void)
+{
+    return source_on;
+}
+
+void
+pardiff_source_set_lines(int lines)
+{
+    context_lines = lines;
+}
+
+int
+pardiff_source_lines(void)
+{
+    return context_lines;
+}
+
+/*
+ * Line n, counting from 1, of side 0 or 1, without its newline; NULL
+ * past the end of the file.  The index is extended as far as needed.
+ */
+const char *
+pardiff_source_line(int side, long long n, size_t *len)
+{
+    source_t *const src = &sources[side];
+
+    if (!source_on || n <= 0) return NULL;
+    while ((size_t)n >= src->nstarts && src->scanned < src->size) {
+        const size_t chunk = src->size - src->scanned < SOURCE_INDEX_CHUNK
+                           ? src->size - src->scanned : SOURCE_INDEX_CHUNK;
+        if (src->nstarts + chunk > src->arsz) {
+            src->arsz = (src->nstarts + chunk) * 2;
+            size_t *starts_new = (size_t *)realloc(src->starts, sizeof(size_t) * src->arsz);
+            if (!starts_new) abort();
+            src->starts = starts_new;
+        }
+        src->nstarts += pardiff_line_starts(src->data + src->scanned, chunk, src->scanned,
+                                            src->starts + src->nstarts);
+        src->scanned += chunk;
+    }
+
+    if ((size_t)n > src->nstarts) return NULL;
+    const size_t start = src->starts[n - 1];
+    if (start >= src->size) return NULL;
+    size_t end = (size_t)n < src->nstarts ? src->starts[n] - 1 : src->size;
+    if (end > start && src->data[end - 1] == '\r') --end;
+    *len = end - start;
+    return src->data + start;
+}
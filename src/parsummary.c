@@ -0,0 +1,145 @@
+/***************************************************************************
+ * parsummary.c                                                            *
+ *                                                                         *
+ * Summary mode.  Only the hunk headers are parsed and hunk bodies are     *
+ * skipped, and the counts of hunks and of added, deleted and changed      *
+ * lines are printed per file and in total, like diffstat.                 *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+typedef struct _summary_t {
+    char     *name;
+    long long hunks;
+    long long added;
+    long long deleted;
+    long long changed;
+} summary_t;
+
+static int summary_on = 0;
+
+static summary_t *files = NULL;
+static size_t files_arsz = 0;
+static size_t files_len = 0;
+static summary_t total;
+
+void
+pardiff_summary_set(int on)
+{
+    summary_on = on;
+}
+
+int
+pardiff_summary_active(void)
+{
+    return summary_on;
+}
+
+/*
+ * Start counting one input.
+ */
+void
+pardiff_summary_begin(void)
+{
+    for (size_t i = 0; i < files_len; ++i) {
+        free(files[i].name);
+    }
+    files_len = 0;
+    memset(&total, 0, sizeof(total));
+}
+
+/*
+ * Count the following hunks for the file called name.
+ */
+void
+pardiff_summary_file(const char *name, size_t len)
+{
+    if (files_len == files_arsz) {
+        files_arsz = files_arsz ? files_arsz * 2 : 16;
+        summary_t *files_new = (summary_t *)realloc(files, sizeof(summary_t) * files_arsz);
+        if (!files_new) abort();
+        files = files_new;
+    }
+    summary_t *const sf = &files[files_len++];
+    memset(sf, 0, sizeof(*sf));
+    sf->name = (char *)malloc(len + 1);
+    if (!sf->name) abort();
+    memcpy(sf->name, name, len);
+    sf->name[len] = '\0';
+}
+
+/*
+ * A "diff [options] FILE1 FILE2" line of a recursive diff; the file is
+ * named after FILE2.
+ */
+void
+pardiff_summary_diff_line(const char *line, size_t len)
+{
+    while (len > 0 && isspace((unsigned char)line[len - 1])) --len;
+    size_t start = len;
+    while (start > 0 && !isspace((unsigned char)line[start - 1])) --start;
+    pardiff_summary_file(line + start, len - start);
+}
+
+/*
+ * Count one hunk.  Changed lines on the two sides are paired off; what
+ * is left over on either side counts as added or deleted.
+ */
+void
+pardiff_summary_hunk(long long added, long long deleted,
+                     long long changed_old, long long changed_new)
+{
+    const long long paired = changed_old < changed_new ? changed_old : changed_new;
+    summary_t *const sf = files_len ? &files[files_len - 1] : NULL;
+
+    added += changed_new - paired;
+    deleted += changed_old - paired;
+    if (sf) {
+        ++sf->hunks;
+        sf->added += added;
+        sf->deleted += deleted;
+        sf->changed += paired;
+    }
+    ++total.hunks;
+    total.added += added;
+    total.deleted += deleted;
+    total.changed += paired;
+}
+
+/*
+ * Print the counts of the input.
+ */
+void
+pardiff_summary_end(void)
+{
+    int name_wid = 0;
+    long long nfiles = 0;
+
+    for (size_t i = 0; i < files_len; ++i) {
+        const int len = (int)strlen(files[i].name);
+        if (len > name_wid) name_wid = len;
+    }
+    for (size_t i = 0; i < files_len; ++i) {
+        const summary_t *const sf = &files[i];
+        if (sf->hunks == 0) continue;
+        ++nfiles;
+        printf(" %-*s | %6lld hunk%s %8lld+ %8lld- %8lld!\n",
+               name_wid, sf->name, sf->hunks, sf->hunks == 1 ? " " : "s",
+               sf->added, sf->deleted, sf->changed);
+    }
+    if (files_len == 0 && total.hunks > 0) {
+        nfiles = 1;     /* a plain diff of two files */
+    }
+    printf(" %lld file%s, %lld hunk%s, %lld added, %lld deleted, %lld changed\n",
+           nfiles, nfiles == 1 ? "" : "s", total.hunks, total.hunks == 1 ? "" : "s",
+           total.added, total.deleted, total.changed);
+    pardiff_summary_begin();
+}
@@ -0,0 +1,305 @@
+/***************************************************************************
+ * paruring.c                                                              *
+ *                                                                         *
+ * io_uring backend for runs over many input files.  The inputs coming up  *
+ * are opened through one ring, and as each open lands the readahead of   *
+ * its file is asked for through the ring too, so that the opens of a cold *
+ * tree and the reads of their heads are in flight at the device at once   *
+ * while earlier files are rendered.  The parser then reads each file the  *
+ * usual way, once, from the page cache.                                   *
+ *                                                                         *
+ * Built with configure --enable-io-uring; the kernel interface is used    *
+ * directly, so there is nothing to link.  Where the ring cannot be set    *
+ * up, inputs are opened with stdio as they are without it.                *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifdef PARDIFF_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* what a completion was for, in the low bits of its user_data */
+#define URING_OP_OPEN  0
+#define URING_OP_ADVISE 1
+#define URING_OP_BITS  1
+
+typedef enum uring_states {
+    usFree,
+    usOpening,
+    usAdvising,
+    usDone
+} uring_state_t;
+
+/* one input file on its way in */
+typedef struct _uring_slot_t {
+    uring_state_t state;
+    int     fd;
+    int     err;        /* errno of the open that failed */
+} uring_slot_t;
+
+static int ring_fd = -1;
+static unsigned *sq_head;
+static unsigned *sq_tail;
+static unsigned *sq_mask;
+static unsigned *sq_array;
+static unsigned *cq_head;
+static unsigned *cq_tail;
+static unsigned *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+static unsigned sq_queued = 0;      /* filled in but not yet submitted */
+
+static uring_slot_t slots[PARDIFF_PREFETCH_FILES];
+
+static int
+uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    const unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * Hand the queued entries to the kernel, and with wait, block until at
+ * least one completion is there to be reaped.
+ */
+static int
+uring_submit(int wait)
+{
+    for (;;) {
+        const int n = uring_enter(sq_queued, wait ? 1 : 0);
+        if (n >= 0) {
+            sq_queued -= (unsigned)n < sq_queued ? (unsigned)n : sq_queued;
+            return 0;
+        }
+        if (errno != EINTR) return 1;
+    }
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *sq_tail;
+    if (tail - head == sq_entries) {
+        /* full: let the kernel take what is queued */
+        uring_submit(0);
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) return NULL;
+    }
+
+    const unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *const sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++sq_queued;
+    return sqe;
+}
+
+static void
+uring_queue_advise(int slot)
+{
+    uring_slot_t *const s = &slots[slot];
+    struct io_uring_sqe *const sqe = uring_get_sqe();
+    if (!sqe) {
+        /* cannot happen with one entry per slot, and is only a hint */
+        s->state = usDone;
+        return;
+    }
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = s->fd;
+    sqe->off = 0;
+    sqe->len = PARDIFF_PREFETCH_BYTES;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    sqe->user_data = ((uint64_t)slot << URING_OP_BITS) | URING_OP_ADVISE;
+    s->state = usAdvising;
+}
+
+/*
+ * Take every completion there is.  An open that succeeded has the
+ * readahead of its file queued behind it, if it is a regular file; the
+ * kernel starts the reads into the page cache and nothing is copied out,
+ * so the parser still reads the file only once.  A failed hint is not an
+ * error.
+ */
+static void
+uring_reap(void)
+{
+    unsigned head = *cq_head;
+    const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *const cqe = &cqes[head & *cq_mask];
+        const int op = (int)(cqe->user_data & ((1 << URING_OP_BITS) - 1));
+        const int slot = (int)(cqe->user_data >> URING_OP_BITS);
+        uring_slot_t *const s = &slots[slot];
+        struct stat st;
+
+        if (op == URING_OP_OPEN && cqe->res >= 0) {
+            s->fd = cqe->res;
+            if (fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                uring_queue_advise(slot);
+                continue;
+            }
+        } else if (op == URING_OP_OPEN) {
+            s->err = -cqe->res;
+        }
+        s->state = usDone;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Whether this kernel does the operations the backend needs.
+ */
+static int
+uring_supported(void)
+{
+    const size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *const probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe) abort();
+
+    int ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int ops[] = { IORING_OP_OPENAT, IORING_OP_FADVISE };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+/*
+ * Set up the ring.  Returns 0, or 1 if inputs are to be opened with
+ * stdio instead.
+ */
+int
+pardiff_uring_open(void)
+{
+    struct io_uring_params p;
+
+    if (ring_fd >= 0) return 0;
+    memset(&p, 0, sizeof(p));
+    ring_fd = (int)syscall(__NR_io_uring_setup, 4 * PARDIFF_PREFETCH_FILES, &p);
+    if (ring_fd < 0) return 1;
+    if (!uring_supported()) {
+        close(ring_fd);
+        ring_fd = -1;
+        return 1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    const int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size) sq_size = cq_size;
+
+    char *const sq = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring_fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !single) {
+        cq = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, IORING_OFF_CQ_RING);
+    }
+    void *const sqe_map = (sq == MAP_FAILED || cq == MAP_FAILED) ? MAP_FAILED
+                        : mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               ring_fd, IORING_OFF_SQES);
+    if (sqe_map == MAP_FAILED) {
+        /* the process is about to fall back, so what was mapped can stay */
+        close(ring_fd);
+        ring_fd = -1;
+        return 1;
+    }
+
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    sqes = (struct io_uring_sqe *)sqe_map;
+    sq_entries = p.sq_entries;
+    return 0;
+}
+
+/*
+ * Start opening fn into slot.  The name must stay valid
+ * until the slot is taken.  Nothing is submitted until a file is taken,
+ * so the opens of a whole window go to the kernel in one call.
+ */
+void
+pardiff_uring_prefetch(int slot, const char *fn)
+{
+    uring_slot_t *const s = &slots[slot];
+
+    s->fd = -1;
+    s->err = 0;
+
+    struct io_uring_sqe *const sqe = uring_get_sqe();
+    if (!sqe) {
+        s->err = EAGAIN;
+        s->state = usDone;
+        return;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)fn;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = ((uint64_t)slot << URING_OP_BITS) | URING_OP_OPEN;
+    s->state = usOpening;
+}
+
+/*
+ * Wait for slot's file and return it as a stream from its start, or
+ * NULL with its errno in *err.
+ */
+FILE *
+pardiff_uring_take(int slot, int *err)
+{
+    uring_slot_t *const s = &slots[slot];
+    FILE *fp = NULL;
+
+    uring_reap();
+    while (s->state != usDone) {
+        if (uring_submit(1) != 0) {
+            /* the ring broke down; a file already open is read in turn */
+            if (s->fd < 0) s->err = errno;
+            break;
+        }
+        uring_reap();
+    }
+    s->state = usFree;
+
+    if (s->fd >= 0) {
+        fp = fdopen(s->fd, "r");
+        s->err = fp ? 0 : errno;
+    }
+    if (fp) {
+        setvbuf(fp, NULL, _IOFBF, PARDIFF_IO_BUF_SIZE);
+    } else if (s->fd >= 0) {
+        close(s->fd);
+    }
+    s->fd = -1;
+
+    /* the readahead of the files behind this one need not wait for it */
+    if (sq_queued > 0) uring_submit(0);
+
+    *err = s->err;
+    return fp;
+}
+
+#endif /* PARDIFF_IO_URING */
@@ -0,0 +1,615 @@
+/***************************************************************************
+ * parwatch.c                                                              *
+ *                                                                         *
+ * Watch mode.  Two files are compared in-process and the differences are  *
+ * rendered as usual; then the files are watched, and after every edit     *
+ * only the region around it is compared again and only the hunks that    *
+ * came out of that region are drawn.                                      *
+ *                                                                         *
+ * Usage: pardiff --watch FILE1 FILE2                                      *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "pardiff.h"
+
+#ifndef PARDIFF_IS_DOS
+
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/* how often the files are looked at without inotify */
+#define WATCH_POLL_MS 500
+
+/* a save often comes as several events; wait this long for the rest */
+#define WATCH_SETTLE_MS 50
+
+typedef struct _watch_line_t {
+    size_t  off;                /* start in the file buffer */
+    size_t  len;                /* without the newline */
+    unsigned long long hash;
+} watch_line_t;
+
+typedef struct _watch_file_t {
+    const char   *name;
+    const char   *base;         /* name without its directory */
+    char         *buf;
+    size_t        size;
+    watch_line_t *lines;
+    long long     nlines;
+    struct stat   st;
+} watch_file_t;
+
+/* lines lo..hi-1 of each side differ; lo == hi on one side for a or d */
+typedef struct _watch_hunk_t {
+    long long lo[2];
+    long long hi[2];
+    int       fresh;            /* not drawn yet */
+} watch_hunk_t;
+
+static watch_file_t files[2];
+
+static watch_hunk_t *hunks = NULL;
+static long long nhunks = 0;
+
+/* state of one comparison */
+static char *del_a = NULL;      /* per line of the region, 1 if deleted */
+static char *ins_b = NULL;      /* per line of the region, 1 if inserted */
+static long long base_a = 0;
+static long long base_b = 0;
+static long long *vf = NULL;    /* furthest reaching paths, forward */
+static long long *vb = NULL;    /* and backward */
+
+/*
+ * Read the whole of a file.  Returns 0, or -1 with errno set.
+ */
+static int
+read_file(const char *name, char **buf, size_t *size, struct stat *st)
+{
+    const int fd = open(name, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) != 0) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    size_t arsz = (size_t)st->st_size + 1;
+    size_t len = 0;
+    char *data = (char *)malloc(arsz);
+    if (!data) abort();
+    for (;;) {
+        if (len == arsz) {
+            arsz *= 2;
+            char *data_new = (char *)realloc(data, arsz);
+            if (!data_new) abort();
+            data = data_new;
+        }
+        const ssize_t n = read(fd, data + len, arsz - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            const int err = errno;
+            free(data);
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    close(fd);
+
+    *buf = data;
+    *size = len;
+    return 0;
+}
+
+/*
+ * Split buf[from..to) into lines, appending them to lines[n..].
+ * Returns the new count.
+ */
+static long long
+split_lines(const char *buf, size_t from, size_t to,
+            watch_line_t **lines, long long n, size_t *arsz)
+{
+    while (from < to) {
+        const char *const nl = (const char *)memchr(buf + from, '\n', to - from);
+        const size_t len = nl ? (size_t)(nl - (buf + from)) : to - from;
+        if ((size_t)n == *arsz) {
+            *arsz = *arsz ? *arsz * 2 : 1024;
+            watch_line_t *lines_new = (watch_line_t *)realloc(*lines, sizeof(watch_line_t) * *arsz);
+            if (!lines_new) abort();
+            *lines = lines_new;
+        }
+        watch_line_t *const ln = &(*lines)[n++];
+        ln->off = from;
+        ln->len = len;
+        ln->hash = pardiff_memo_hash(PARDIFF_MEMO_HASH_INIT, buf + from, len);
+        from += len + 1;
+    }
+    return n;
+}
+
+static int
+load_file(watch_file_t *wf, const char *name)
+{
+    size_t arsz = 0;
+    const char *const slash = strrchr(name, '/');
+
+    memset(wf, 0, sizeof(*wf));
+    wf->name = name;
+    wf->base = slash ? slash + 1 : name;
+    if (read_file(name, &wf->buf, &wf->size, &wf->st) != 0) return -1;
+    wf->nlines = split_lines(wf->buf, 0, wf->size, &wf->lines, 0, &arsz);
+    return 0;
+}
+
+/*
+ * Read a file again.  The lines of the common prefix and suffix with
+ * the old contents are kept as they were, so only the edited lines in
+ * between are split and hashed.  The edit replaced old lines p..*old_q-1
+ * with new lines p..*new_q-1.  Returns 1 if the file changed, 0 if not
+ * and -1 if it could not be read.
+ */
+static int
+reload_file(watch_file_t *wf, long long *p, long long *old_q, long long *new_q)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    struct stat st;
+
+    if (read_file(wf->name, &buf, &size, &st) != 0) return -1;
+    wf->st = st;
+    if (size == wf->size && memcmp(buf, wf->buf, size) == 0) {
+        free(buf);
+        return 0;
+    }
+
+    /* common bytes at either end */
+    const size_t min_size = size < wf->size ? size : wf->size;
+    size_t pre = 0;
+    while (pre < min_size && buf[pre] == wf->buf[pre]) ++pre;
+    size_t suf = 0;
+    while (suf < min_size - pre && buf[size - 1 - suf] == wf->buf[wf->size - 1 - suf]) ++suf;
+
+    /* whole lines within them, newline included */
+    long long lo = 0;
+    long long hi = wf->nlines;
+    while (lo < hi) {
+        const long long mid = lo + (hi - lo) / 2;
+        if (wf->lines[mid].off + wf->lines[mid].len + 1 <= pre) lo = mid + 1;
+        else hi = mid;
+    }
+    const long long np = lo;
+    hi = wf->nlines;
+    while (lo < hi) {
+        const long long mid = lo + (hi - lo) / 2;
+        if (wf->lines[mid].off > wf->size - suf) hi = mid;
+        else lo = mid + 1;
+    }
+    const long long ns = wf->nlines - lo;
+
+    /* new lines: the prefix as is, the middle split again, the suffix moved */
+    const size_t mid_from = np ? wf->lines[np - 1].off + wf->lines[np - 1].len + 1 : 0;
+    const size_t mid_to = ns ? wf->lines[wf->nlines - ns].off + size - wf->size : size;
+    size_t arsz = (size_t)(np + ns) + 1024;
+    watch_line_t *lines = (watch_line_t *)malloc(sizeof(watch_line_t) * arsz);
+    if (!lines) abort();
+    if (np > 0) memcpy(lines, wf->lines, sizeof(watch_line_t) * (size_t)np);
+    long long n = split_lines(buf, mid_from, mid_to, &lines, np, &arsz);
+    if ((size_t)(n + ns) > arsz) {
+        arsz = (size_t)(n + ns);
+        watch_line_t *lines_new = (watch_line_t *)realloc(lines, sizeof(watch_line_t) * arsz);
+        if (!lines_new) abort();
+        lines = lines_new;
+    }
+    for (long long i = wf->nlines - ns; i < wf->nlines; ++i) {
+        lines[n] = wf->lines[i];
+        lines[n++].off += size - wf->size;
+    }
+
+    *p = np;
+    *old_q = wf->nlines - ns;
+    *new_q = n - ns;
+
+    free(wf->buf);
+    free(wf->lines);
+    wf->buf = buf;
+    wf->size = size;
+    wf->lines = lines;
+    wf->nlines = n;
+    return 1;
+}
+
+static int
+same_line(long long i, long long j)
+{
+    const watch_line_t *const la = &files[0].lines[i];
+    const watch_line_t *const lb = &files[1].lines[j];
+    return la->hash == lb->hash && la->len == lb->len
+        && memcmp(files[0].buf + la->off, files[1].buf + lb->off, la->len) == 0;
+}
+
+/*
+ * Find where a shortest edit script of a[alo..ahi) into b[blo..bhi)
+ * crosses its middle, by running it from both ends at once (Myers'
+ * linear space refinement).  Neither end may be a common line.
+ */
+static void
+find_split(long long alo, long long ahi, long long blo, long long bhi,
+           long long *xs, long long *ys)
+{
+    const long long n = ahi - alo;
+    const long long m = bhi - blo;
+    const long long delta = n - m;
+    const int odd = (int)(delta & 1);
+    const long long dmax = (n + m + 1) / 2;
+    long long *const f = vf + dmax + 1;
+    long long *const b = vb + dmax + 1;
+
+    f[1] = 0;
+    b[1] = 0;
+    for (long long d = 0; d <= dmax; ++d) {
+        for (long long k = -d; k <= d; k += 2) {
+            long long x = (k == -d || (k != d && f[k - 1] < f[k + 1])) ? f[k + 1] : f[k - 1] + 1;
+            long long y = x - k;
+            while (x < n && y < m && same_line(alo + x, blo + y)) ++x, ++y;
+            f[k] = x;
+            if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 && x + b[delta - k] >= n) {
+                *xs = alo + x;
+                *ys = blo + y;
+                return;
+            }
+        }
+        for (long long k = -d; k <= d; k += 2) {
+            long long x = (k == -d || (k != d && b[k - 1] < b[k + 1])) ? b[k + 1] : b[k - 1] + 1;
+            long long y = x - k;
+            while (x < n && y < m && same_line(ahi - 1 - x, bhi - 1 - y)) ++x, ++y;
+            b[k] = x;
+            if (!odd && delta - k >= -d && delta - k <= d && x + f[delta - k] >= n) {
+                *xs = ahi - x;
+                *ys = bhi - y;
+                return;
+            }
+        }
+    }
+    /* not reached: the paths meet by d == dmax */
+    *xs = alo;
+    *ys = blo;
+}
+
+static void
+compare(long long alo, long long ahi, long long blo, long long bhi)
+{
+    while (alo < ahi && blo < bhi && same_line(alo, blo)) ++alo, ++blo;
+    while (alo < ahi && blo < bhi && same_line(ahi - 1, bhi - 1)) --ahi, --bhi;
+
+    if (alo == ahi) {
+        memset(ins_b + (blo - base_b), 1, (size_t)(bhi - blo));
+    }
+    else if (blo == bhi) {
+        memset(del_a + (alo - base_a), 1, (size_t)(ahi - alo));
+    }
+    else {
+        long long x = 0;
+        long long y = 0;
+        find_split(alo, ahi, blo, bhi, &x, &y);
+        compare(alo, x, blo, y);
+        compare(x, ahi, y, bhi);
+    }
+}
+
+/*
+ * Compare a[alo..ahi) with b[blo..bhi) and return the hunks found, in
+ * order, in a new array.
+ */
+static watch_hunk_t *
+diff_region(long long alo, long long ahi, long long blo, long long bhi,
+            long long *count)
+{
+    const long long na = ahi - alo;
+    const long long nb = bhi - blo;
+    const size_t vsize = (size_t)((na + nb + 1) / 2) * 2 + 3;
+
+    del_a = (char *)calloc((size_t)na + 1, 1);
+    ins_b = (char *)calloc((size_t)nb + 1, 1);
+    vf = (long long *)malloc(sizeof(long long) * vsize);
+    vb = (long long *)malloc(sizeof(long long) * vsize);
+    if (!del_a || !ins_b || !vf || !vb) abort();
+    base_a = alo;
+    base_b = blo;
+
+    compare(alo, ahi, blo, bhi);
+
+    size_t arsz = 16;
+    long long n = 0;
+    watch_hunk_t *found = (watch_hunk_t *)malloc(sizeof(watch_hunk_t) * arsz);
+    if (!found) abort();
+    long long i = alo;
+    long long j = blo;
+    while (i < ahi || j < bhi) {
+        if ((i < ahi && del_a[i - alo]) || (j < bhi && ins_b[j - blo])) {
+            if ((size_t)n == arsz) {
+                arsz *= 2;
+                watch_hunk_t *found_new = (watch_hunk_t *)realloc(found, sizeof(watch_hunk_t) * arsz);
+                if (!found_new) abort();
+                found = found_new;
+            }
+            watch_hunk_t *const h = &found[n++];
+            h->lo[0] = i;
+            h->lo[1] = j;
+            while ((i < ahi && del_a[i - alo]) || (j < bhi && ins_b[j - blo])) {
+                while (i < ahi && del_a[i - alo]) ++i;
+                while (j < bhi && ins_b[j - blo]) ++j;
+            }
+            h->hi[0] = i;
+            h->hi[1] = j;
+            h->fresh = 1;
+        }
+        else {
+            ++i;
+            ++j;
+        }
+    }
+
+    free(del_a);
+    free(ins_b);
+    free(vf);
+    free(vb);
+    del_a = ins_b = NULL;
+    vf = vb = NULL;
+
+    *count = n;
+    return found;
+}
+
+/*
+ * File x had lines p..old_q-1 replaced by p..new_q-1.  The hunks that
+ * touch that range are compared again, together with the edit, and
+ * replaced by what comes out; the ones after it only move.
+ */
+static void
+update_hunks(int x, long long p, long long old_q, long long new_q)
+{
+    const int y = 1 - x;
+    const long long shift = new_q - old_q;
+
+    long long first = 0;
+    while (first < nhunks && hunks[first].hi[x] < p) ++first;
+    long long last = first;
+    while (last < nhunks && hunks[last].lo[x] <= old_q) ++last;
+
+    long long lo[2];
+    long long hi[2];
+    if (first < last && hunks[first].lo[x] <= p) {
+        lo[x] = hunks[first].lo[x];
+        lo[y] = hunks[first].lo[y];
+    } else {
+        lo[x] = p;
+        lo[y] = p + (first > 0 ? hunks[first - 1].hi[y] - hunks[first - 1].hi[x] : 0);
+    }
+    if (first < last && hunks[last - 1].hi[x] >= old_q) {
+        hi[x] = hunks[last - 1].hi[x];
+        hi[y] = hunks[last - 1].hi[y];
+    } else {
+        hi[x] = old_q;
+        hi[y] = old_q + (last > 0 ? hunks[last - 1].hi[y] - hunks[last - 1].hi[x] : 0);
+    }
+    hi[x] += shift;
+
+    long long nfound = 0;
+    watch_hunk_t *const found = diff_region(lo[0], hi[0], lo[1], hi[1], &nfound);
+
+    const long long nafter = nhunks - last;
+    watch_hunk_t *hunks_new = (watch_hunk_t *)malloc(sizeof(watch_hunk_t) * (size_t)(first + nfound + nafter + 1));
+    if (!hunks_new) abort();
+    memcpy(hunks_new, hunks, sizeof(watch_hunk_t) * (size_t)first);
+    memcpy(hunks_new + first, found, sizeof(watch_hunk_t) * (size_t)nfound);
+    memcpy(hunks_new + first + nfound, hunks + last, sizeof(watch_hunk_t) * (size_t)nafter);
+    for (long long i = first + nfound; i < first + nfound + nafter; ++i) {
+        hunks_new[i].lo[x] += shift;
+        hunks_new[i].hi[x] += shift;
+    }
+
+    free(found);
+    free(hunks);
+    hunks = hunks_new;
+    nhunks = first + nfound + nafter;
+}
+
+static void
+put_range(FILE *out, long long from, long long to)
+{
+    if (from == to) fprintf(out, "%lld", from);
+    else fprintf(out, "%lld,%lld", from, to);
+}
+
+static void
+put_lines(FILE *out, const watch_file_t *wf, const char *tag, long long lo, long long hi)
+{
+    for (long long i = lo; i < hi; ++i) {
+        fputs(tag, out);
+        fwrite(wf->buf + wf->lines[i].off, 1, wf->lines[i].len, out);
+        putc('\n', out);
+    }
+}
+
+/*
+ * Write the fresh hunks as a normal diff and render that.
+ */
+static int
+draw_fresh(const char *prog, int (*render)(const char *prog, FILE *fp))
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return 1;
+    }
+    for (long long i = 0; i < nhunks; ++i) {
+        watch_hunk_t *const h = &hunks[i];
+        if (!h->fresh) continue;
+        h->fresh = 0;
+        const char cmd = h->lo[0] == h->hi[0] ? 'a' : h->lo[1] == h->hi[1] ? 'd' : 'c';
+        put_range(out, cmd == 'a' ? h->lo[0] : h->lo[0] + 1, h->hi[0]);
+        putc(cmd, out);
+        put_range(out, cmd == 'd' ? h->lo[1] : h->lo[1] + 1, h->hi[1]);
+        putc('\n', out);
+        put_lines(out, &files[0], "< ", h->lo[0], h->hi[0]);
+        if (cmd == 'c') fputs("---\n", out);
+        put_lines(out, &files[1], "> ", h->lo[1], h->hi[1]);
+    }
+    fclose(out);
+
+    int rc = 0;
+    if (len > 0) {
+        FILE *const fp = fmemopen(text, len, "r");
+        if (!fp) {
+            perror("fmemopen");
+            rc = 1;
+        } else {
+            rc = render(prog, fp);
+            fclose(fp);
+        }
+    }
+    free(text);
+    PARDIFF_PROBE(flush);
+    fflush(stdout);
+    return rc;
+}
+
+/*
+ * Block until one of the files may have changed, and mark which.
+ */
+static void
+wait_for_change(int ifd, int changed[2])
+{
+#ifdef __linux__
+    if (ifd >= 0) {
+        char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        int timeout = -1;
+        for (;;) {
+            struct pollfd pfd = { ifd, POLLIN, 0 };
+            const int ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) break;
+            const ssize_t n = read(ifd, evbuf, sizeof(evbuf));
+            if (n <= 0) break;
+            for (char *cp = evbuf; cp < evbuf + n; ) {
+                const struct inotify_event *const ev = (const struct inotify_event *)cp;
+                for (int s = 0; s < 2; ++s) {
+                    if (ev->len > 0 && strcmp(ev->name, files[s].base) == 0) changed[s] = 1;
+                }
+                cp += sizeof(struct inotify_event) + ev->len;
+            }
+            /* gather the rest of the save before looking */
+            timeout = WATCH_SETTLE_MS;
+        }
+        return;
+    }
+#else
+    (void)ifd;
+#endif
+
+    for (;;) {
+        const struct timespec ts = { WATCH_POLL_MS / 1000, (WATCH_POLL_MS % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+        for (int s = 0; s < 2; ++s) {
+            struct stat st;
+            if (stat(files[s].name, &st) != 0) continue;
+            if (st.st_mtime != files[s].st.st_mtime || st.st_size != files[s].st.st_size
+                || st.st_ino != files[s].st.st_ino) {
+                changed[s] = 1;
+            }
+        }
+        if (changed[0] || changed[1]) return;
+    }
+}
+
+/*
+ * Watch the directories the files are in rather than the files, since
+ * editors often save by writing a new file and renaming it.
+ */
+static int
+watch_dirs(void)
+{
+    int ifd = -1;
+#ifdef __linux__
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) return -1;
+    for (int s = 0; s < 2; ++s) {
+        char dir[PARDIFF_LINE_BUF_SIZE];
+        const size_t len = (size_t)(files[s].base - files[s].name);
+        if (len == 0) {
+            strcpy(dir, ".");
+        } else if (len < sizeof(dir)) {
+            memcpy(dir, files[s].name, len);
+            dir[len] = '\0';
+        } else {
+            close(ifd);
+            return -1;
+        }
+        if (inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            close(ifd);
+            return -1;
+        }
+    }
+#endif
+    return ifd;
+}
+
+int
+pardiff_watch_main(const char *prog, const char *name1, const char *name2,
+                   int (*render)(const char *prog, FILE *fp))
+{
+    for (int s = 0; s < 2; ++s) {
+        if (load_file(&files[s], s ? name2 : name1) != 0) {
+            perror(s ? name2 : name1);
+            return 1;
+        }
+    }
+
+    hunks = diff_region(0, files[0].nlines, 0, files[1].nlines, &nhunks);
+    int rc = draw_fresh(prog, render);
+
+    const int ifd = watch_dirs();
+    for (;;) {
+        int changed[2] = { 0, 0 };
+        int edited[2] = { 0, 0 };
+        wait_for_change(ifd, changed);
+
+        for (int s = 0; s < 2; ++s) {
+            long long p = 0;
+            long long old_q = 0;
+            long long new_q = 0;
+            /* a file that is missing now is being replaced; wait for it */
+            if (!changed[s] || reload_file(&files[s], &p, &old_q, &new_q) <= 0) continue;
+            update_hunks(s, p, old_q, new_q);
+            edited[s] = 1;
+        }
+        if (!edited[0] && !edited[1]) continue;
+
+        long long nfresh = 0;
+        for (long long i = 0; i < nhunks; ++i) nfresh += hunks[i].fresh;
+        printf("%s%s%s changed: %lld of %lld hunk%s redrawn\n",
+               edited[0] ? files[0].name : "", edited[0] && edited[1] ? " and " : "",
+               edited[1] ? files[1].name : "", nfresh, nhunks, nhunks == 1 ? "" : "s");
+        rc = draw_fresh(prog, render);
+    }
+
+    return rc;
+}
+
+#endif